@@ -23,12 +23,43 @@ Contact: Tobias Rausch (rausch@embl.de)
 #define ALIGN_H
 
 #include <boost/multi_array.hpp>
+#include <boost/dynamic_bitset.hpp>
 
 #include <iostream>
+#include <vector>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace torali
 {
 
+  // Reusable buffers of the alignment kernels and the decoded read, one per thread
+  struct AlignWorkspace {
+    std::vector<int32_t> row1;
+    std::vector<int32_t> row2;
+    std::vector<int16_t> prof;
+    std::vector<int16_t> hp;
+    std::vector<int16_t> hc;
+    boost::dynamic_bitset<> bit3;
+    boost::dynamic_bitset<> bit4;
+    std::vector<char> trace;
+    std::string sequence;
+    std::vector<uint8_t> quality;
+  };
+
+  // Column counts of a sub-alignment ('A', 'C', 'G', 'T', 'N', '-'), the letters are only kept for single sequences
+  struct AlignProfile {
+    uint32_t nseq;
+    std::string seq;
+    std::vector<uint32_t> counts;
+    std::vector<char> trace;
+
+    AlignProfile() : nseq(0) {}
+  };
+
   template<typename TScoreValue>
   struct DnaScore {
     typedef TScoreValue TValue;
@@ -113,6 +144,13 @@ namespace torali
     return 1;
   }
 
+  template<typename TDimension>
+  inline std::size_t
+  _size(AlignProfile const& a, TDimension const i) {
+    if (i) return a.counts.size() / 6;
+    return a.nseq;
+  }
+
 
   template<typename TProfile, typename TAIndex, typename TScore>
   inline int
@@ -180,6 +218,90 @@ namespace torali
     }
   }
 
+  inline int
+  _profileIndex(char const c) {
+    switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    case 'N': case 'n': return 4;
+    case '-': return 5;
+    default: return 6;
+    }
+  }
+
+  inline void
+  _initProfile(std::string const& s, AlignProfile& a) {
+    a.nseq = 1;
+    a.seq = s;
+    a.counts.assign(6 * s.size(), 0);
+    a.trace.clear();
+    for(std::size_t j = 0; j < s.size(); ++j) {
+      int k = _profileIndex(s[j]);
+      if (k < 6) ++a.counts[6 * j + k];
+    }
+  }
+
+  template<typename TProfile>
+  inline void
+  _createProfile(AlignProfile const& a, TProfile& p)
+  {
+    typedef typename TProfile::index TPIndex;
+    std::size_t cols = _size(a, 1);
+    p.resize(boost::extents[6][cols]);   // 'A', 'C', 'G', 'T', 'N', '-'
+    for (std::size_t j = 0; j < cols; ++j) {
+      uint32_t const* cnt = &a.counts[6 * j];
+      int sum = cnt[0] + cnt[1] + cnt[2] + cnt[3] + cnt[4] + cnt[5];
+      for(TPIndex k = 0; k<6; ++k) p[k][j] = (float) cnt[k] / sum;
+    }
+  }
+
+  // Substitution scores of one row against all columns
+  template<typename TAlign1, typename TAlign2, typename TProfile, typename TScore, typename TScoreValue>
+  inline void
+  _scoreRow(TAlign1 const& a1, TAlign2 const& a2, TProfile const& p1, TProfile const& p2, std::size_t const row, TScore const& sc, std::vector<TScoreValue>& sub)
+  {
+    std::size_t n = _size(a2, 1);
+    sub.resize(n);
+    for(std::size_t col = 0; col < n; ++col) sub[col] = _score(a1, a2, p1, p2, row, col, sc);
+  }
+
+  template<typename TProfile, typename TScore, typename TScoreValue>
+  inline void
+  _scoreRow(AlignProfile const& a1, AlignProfile const& a2, TProfile const& p1, TProfile const& p2, std::size_t const row, TScore const& sc, std::vector<TScoreValue>& sub)
+  {
+    typedef typename TProfile::index TPIndex;
+    std::size_t n = _size(a2, 1);
+    sub.resize(n);
+    if ((a1.nseq == 1) && (a2.nseq == 1)) {
+      for(std::size_t col = 0; col < n; ++col) sub[col] = (a1.seq[row] == a2.seq[col] ? sc.match : sc.mismatch);
+      return;
+    }
+    // Same float evaluation order as _score, four columns at a time
+    std::size_t col = 0;
+#ifdef __SSE2__
+    for(; col + 4 <= n; col += 4) {
+      __m128 score = _mm_setzero_ps();
+      for(TPIndex k1 = 0; k1<5; ++k1) {
+	__m128 f1 = _mm_set1_ps(p1[k1][row]);
+	for(TPIndex k2 = 0; k2<5; ++k2)
+	  score = _mm_add_ps(score, _mm_mul_ps(_mm_mul_ps(f1, _mm_loadu_ps(&p2[k2][col])), _mm_set1_ps((float) ((k1 == k2) ? sc.match : sc.mismatch))));
+      }
+      int32_t tmp[4];
+      _mm_storeu_si128((__m128i*) tmp, _mm_cvttps_epi32(score));
+      for(int32_t i = 0; i < 4; ++i) sub[col + i] = tmp[i];
+    }
+#endif
+    for(; col < n; ++col) {
+      float score = 0;
+      for(TPIndex k1 = 0; k1<5; ++k1) 
+	for(TPIndex k2 = 0; k2<5; ++k2) 
+	  score += p1[k1][row] * p2[k2][col] * ( (k1 == k2) ? sc.match : sc.mismatch );
+      sub[col] = (int) score;
+    }
+  }
+
   template<typename TTrace, typename TAlign>
   inline void
   _createLocalAlignment(TTrace const& trace, std::string const& s1, std::string const& s2, TAlign& align, int32_t const maxRow, int32_t const maxCol)
@@ -238,6 +360,35 @@ namespace torali
     }
   }
 
+  // Merged column counts, the trace is kept to lay out the letters later
+  template<typename TTrace>
+  inline void
+  _createAlignment(TTrace const& trace, AlignProfile const& a1, AlignProfile const& a2, AlignProfile& align)
+  {
+    align.nseq = a1.nseq + a2.nseq;
+    align.seq.clear();
+    align.counts.assign(6 * trace.size(), 0);
+    align.trace.assign(trace.rbegin(), trace.rend());
+    std::size_t row = 0;
+    std::size_t col = 0;
+    for(std::size_t ai = 0; ai < align.trace.size(); ++ai) {
+      uint32_t* cnt = &align.counts[6 * ai];
+      if (align.trace[ai] == 's') {
+	for(int k = 0; k < 6; ++k) cnt[k] = a1.counts[6 * row + k] + a2.counts[6 * col + k];
+	++row;
+	++col;
+      } else if (align.trace[ai] == 'h') {
+	for(int k = 0; k < 6; ++k) cnt[k] = a2.counts[6 * col + k];
+	cnt[5] += a1.nseq;
+	++col;
+      } else {
+	for(int k = 0; k < 6; ++k) cnt[k] = a1.counts[6 * row + k];
+	cnt[5] += a2.nseq;
+	++row;
+      }
+    }
+  }
+
 }
 
 #endif
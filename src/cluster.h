@@ -22,6 +22,8 @@ Contact: Tobias Rausch (rausch@embl.de)
 #ifndef CLUSTER_H
 #define CLUSTER_H
 
+#include <queue>
+
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string.hpp>
@@ -31,6 +33,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/math/distributions/binomial.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <htslib/sam.h>
 
@@ -41,21 +44,21 @@ namespace torali
 {
 
 
-  // Reduced bam alignment record data structure
+  #define DELLY_ADAPTIVE_PRUNING 10
+
+  // Reduced bam alignment record data structure, library statistics are looked up by sample index
   struct BamAlignRecord {
     int32_t tid;         
     int32_t pos;
     int32_t mtid; 
     int32_t mpos;
-    int32_t alen;
-    int32_t malen;
-    int32_t Median;
-    int32_t Mad;
     int32_t maxNormalISize;
-    uint32_t flag;
+    uint16_t alen;
+    uint16_t malen;
+    uint16_t lib;
     uint8_t MapQuality;
   
-    BamAlignRecord(bam1_t* rec, uint8_t pairQuality, uint16_t a, uint16_t ma, int32_t median, int32_t mad, int32_t maxISize) : tid(rec->core.tid), pos(rec->core.pos), mtid(rec->core.mtid), mpos(rec->core.mpos), alen(a), malen(ma), Median(median), Mad(mad), maxNormalISize(maxISize), flag(rec->core.flag), MapQuality(pairQuality) {}
+    BamAlignRecord(bam1_t* rec, uint8_t pairQuality, uint16_t a, uint16_t ma, int32_t maxISize, uint16_t l) : tid(rec->core.tid), pos(rec->core.pos), mtid(rec->core.mtid), mpos(rec->core.mpos), maxNormalISize(maxISize), alen(a), malen(ma), lib(l), MapQuality(pairQuality) {}
   };
 
   // Sort reduced bam alignment records
@@ -79,6 +82,7 @@ namespace torali
   // Edge struct
   template<typename TWeight, typename TVertex>
   struct EdgeRecord {
+    typedef TVertex TVertexType;
     TVertex source;
     TVertex target;
     TWeight weight;
@@ -119,6 +123,64 @@ namespace torali
     }
   };
 
+  // Grow a clique from the first edge of a weight-sorted edge list. The frontier holds the ranks of all
+  // edges leaving the clique, so the best edge to a vertex not yet tried is found without rescanning.
+  template<typename TEdgeList, typename TGrow>
+  inline void
+  _growClique(TEdgeList const& edges, TGrow& grow, std::vector<typename TEdgeList::value_type::TVertexType>& clique) {
+    typedef typename TEdgeList::value_type::TVertexType TVertex;
+    if (edges.empty()) return;
+
+    // Local vertex ids
+    std::vector<TVertex> vertex;
+    vertex.reserve(2 * edges.size());
+    for(uint32_t e = 0; e < edges.size(); ++e) {
+      vertex.push_back(edges[e].source);
+      vertex.push_back(edges[e].target);
+    }
+    std::sort(vertex.begin(), vertex.end());
+    vertex.erase(std::unique(vertex.begin(), vertex.end()), vertex.end());
+
+    // Incident edges per vertex
+    std::vector<uint32_t> src(edges.size());
+    std::vector<uint32_t> tgt(edges.size());
+    std::vector<uint32_t> offset(vertex.size() + 1, 0);
+    for(uint32_t e = 0; e < edges.size(); ++e) {
+      src[e] = std::lower_bound(vertex.begin(), vertex.end(), edges[e].source) - vertex.begin();
+      tgt[e] = std::lower_bound(vertex.begin(), vertex.end(), edges[e].target) - vertex.begin();
+      ++offset[src[e] + 1];
+      ++offset[tgt[e] + 1];
+    }
+    for(uint32_t k = 1; k < offset.size(); ++k) offset[k] += offset[k-1];
+    std::vector<uint32_t> incident(offset.back());
+    std::vector<uint32_t> fill(offset.begin(), offset.end() - 1);
+    for(uint32_t e = 0; e < edges.size(); ++e) {
+      incident[fill[src[e]]++] = e;
+      incident[fill[tgt[e]]++] = e;
+    }
+
+    // 1: clique member, 2: incompatible
+    std::vector<uint8_t> state(vertex.size(), 0);
+    std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t> > frontier;
+    uint32_t v = src[0];
+    state[v] = 1;
+    clique.push_back(vertex[v]);
+    for(uint32_t k = offset[v]; k < offset[v+1]; ++k) frontier.push(incident[k]);
+    while (!frontier.empty()) {
+      uint32_t e = frontier.top();
+      frontier.pop();
+      if ((state[src[e]] != 1) && (state[tgt[e]] == 1)) v = src[e];
+      else if ((state[src[e]] == 1) && (state[tgt[e]] != 1)) v = tgt[e];
+      else continue;
+      if (state[v] == 2) continue;
+      if (grow(vertex[v])) {
+	state[v] = 1;
+	clique.push_back(vertex[v]);
+	for(uint32_t k = offset[v]; k < offset[v+1]; ++k) frontier.push(incident[k]);
+      } else state[v] = 2;
+    }
+  }
+
 
   // Initialize clique, deletions
   template<typename TBamRecord, typename TSize>
@@ -260,6 +322,55 @@ namespace torali
   }
 
 
+  // Breakpoint bounds of a split-read clique, a vertex is accepted if both breakpoints stay within the wiggle
+  struct SRCliqueBounds {
+    std::vector<SRBamRecord> const& br;
+    int32_t wiggle;
+    int32_t ciposlow;
+    int32_t ciposhigh;
+    int32_t ciendlow;
+    int32_t ciendhigh;
+    uint64_t pos;
+    uint64_t pos2;
+    int32_t inslen;
+
+    SRCliqueBounds(std::vector<SRBamRecord> const& b, uint32_t const seed, uint32_t const w) : br(b), wiggle(w), ciposlow(b[seed].pos), ciposhigh(b[seed].pos), ciendlow(b[seed].pos2), ciendhigh(b[seed].pos2), pos(b[seed].pos), pos2(b[seed].pos2), inslen(b[seed].inslen) {}
+
+    inline bool operator()(uint32_t const v) {
+      int32_t newCiPosLow = std::min(br[v].pos, ciposlow);
+      int32_t newCiPosHigh = std::max(br[v].pos, ciposhigh);
+      int32_t newCiEndLow = std::min(br[v].pos2, ciendlow);
+      int32_t newCiEndHigh = std::max(br[v].pos2, ciendhigh);
+      if (((newCiPosHigh - newCiPosLow) >= wiggle) || ((newCiEndHigh - newCiEndLow) >= wiggle)) return false;
+      ciposlow = newCiPosLow;
+      pos += br[v].pos;
+      ciposhigh = newCiPosHigh;
+      ciendlow = newCiEndLow;
+      pos2 += br[v].pos2;
+      ciendhigh = newCiEndHigh;
+      inslen += br[v].inslen;
+      return true;
+    }
+  };
+
+  // SV bounds of a paired-end clique
+  template<typename TBamRecord>
+  struct PECliqueBounds {
+    TBamRecord const& bamRecord;
+    int32_t svt;
+    int32_t svStart;
+    int32_t svEnd;
+    int32_t wiggle;
+
+    PECliqueBounds(TBamRecord const& b, std::size_t const seed, int32_t const s) : bamRecord(b), svt(s), svStart(-1), svEnd(-1), wiggle(0) {
+      _initClique(bamRecord[seed], svStart, svEnd, wiggle, svt);
+    }
+
+    inline bool operator()(std::size_t const v) {
+      return _updateClique(bamRecord[v], svStart, svEnd, wiggle, svt);
+    }
+  };
+
   template<typename TCompEdgeList>
   inline void
   _searchCliques(TCompEdgeList& compEdge, std::vector<SRBamRecord>& br, std::vector<StructuralVariantRecord>& sv, uint32_t const wiggle, int32_t const svt) {
@@ -272,67 +383,25 @@ namespace torali
       // Sort edges by weight
       std::sort(compIt->second.begin(), compIt->second.end(), SortSREdgeRecords<TEdgeRecord>());
 
+      if (compIt->second.empty()) continue;
+
       // Find a large clique
-      typename TEdgeList::const_iterator itWEdge = compIt->second.begin();
-      typename TEdgeList::const_iterator itWEdgeEnd = compIt->second.end();
-      typedef std::set<TVertex> TCliqueMembers;
+      TVertex seed = compIt->second.begin()->source;
+      SRCliqueBounds bounds(br, seed, wiggle);
+      typedef std::vector<TVertex> TCliqueMembers;
       TCliqueMembers clique;
-      TCliqueMembers incompatible;
-      
-      // Initialize clique
-      clique.insert(itWEdge->source);
-      int32_t chr = br[itWEdge->source].chr;
-      int32_t chr2 = br[itWEdge->source].chr2;
-      int32_t ciposlow = br[itWEdge->source].pos;
-      uint64_t pos = br[itWEdge->source].pos;
-      int32_t ciposhigh = br[itWEdge->source].pos; 
-      int32_t ciendlow = br[itWEdge->source].pos2;
-      uint64_t pos2 = br[itWEdge->source].pos2;
-      int32_t ciendhigh = br[itWEdge->source].pos2;
-      int32_t inslen = br[itWEdge->source].inslen;
-
-      // Grow clique
-      bool cliqueGrow = true;
-      while (cliqueGrow) {
-	itWEdge = compIt->second.begin();
-	cliqueGrow = false;
-	// Find next best edge for extension
-	for(;(!cliqueGrow) && (itWEdge != itWEdgeEnd);++itWEdge) {
-	  TVertex v;
-	  if ((clique.find(itWEdge->source) == clique.end()) && (clique.find(itWEdge->target) != clique.end())) v = itWEdge->source;
-	  else if ((clique.find(itWEdge->source) != clique.end()) && (clique.find(itWEdge->target) == clique.end())) v = itWEdge->target;
-	  else continue;
-	  if (incompatible.find(v) != incompatible.end()) continue;
-	  // Try to update clique with this vertex
-	  int32_t newCiPosLow = std::min(br[v].pos, ciposlow);
-	  int32_t newCiPosHigh = std::max(br[v].pos, ciposhigh);
-	  int32_t newCiEndLow = std::min(br[v].pos2, ciendlow);
-	  int32_t newCiEndHigh = std::max(br[v].pos2, ciendhigh);
-	  if (((newCiPosHigh - newCiPosLow) < (int32_t) wiggle) && ((newCiEndHigh - newCiEndLow) < (int32_t) wiggle)) cliqueGrow = true;
-	  if (cliqueGrow) {
-	    // Accept new vertex
-	    clique.insert(v);
-	    ciposlow = newCiPosLow;
-	    pos += br[v].pos;
-	    ciposhigh = newCiPosHigh;
-	    ciendlow = newCiEndLow;
-	    pos2 += br[v].pos2;
-	    ciendhigh = newCiEndHigh;
-	    inslen += br[v].inslen;
-	  } else incompatible.insert(v);
-	}
-      }
+      _growClique(compIt->second, bounds, clique);
 
       // At least 2 split reads?
       if (clique.size()>1) {
-	int32_t svStart = (int32_t) (pos / (uint64_t) clique.size());
-	int32_t svEnd = (int32_t) (pos2 / (uint64_t) clique.size());
-	int32_t svInsLen = (int32_t) (inslen / (int32_t) clique.size());
-	if ((ciposlow > svStart) || (ciposhigh < svStart) || (ciendlow > svEnd) || (ciendhigh < svEnd)) {
-	  std::cerr << "Warning: Confidence intervals out of bounds: " << ciposlow << ',' << svStart << ',' << ciposhigh << ':' << ciendlow << ',' << svEnd << ',' << ciendhigh << std::endl;
+	int32_t svStart = (int32_t) (bounds.pos / (uint64_t) clique.size());
+	int32_t svEnd = (int32_t) (bounds.pos2 / (uint64_t) clique.size());
+	int32_t svInsLen = (int32_t) (bounds.inslen / (int32_t) clique.size());
+	if ((bounds.ciposlow > svStart) || (bounds.ciposhigh < svStart) || (bounds.ciendlow > svEnd) || (bounds.ciendhigh < svEnd)) {
+	  std::cerr << "Warning: Confidence intervals out of bounds: " << bounds.ciposlow << ',' << svStart << ',' << bounds.ciposhigh << ':' << bounds.ciendlow << ',' << svEnd << ',' << bounds.ciendhigh << std::endl;
 	}
 	int32_t svid = sv.size();
-	sv.push_back(StructuralVariantRecord(chr, svStart, chr2, svEnd, (ciposlow - svStart), (ciposhigh - svStart), (ciendlow - svEnd), (ciendhigh - svEnd), clique.size(), svInsLen, svt, svid));
+	sv.push_back(StructuralVariantRecord(br[seed].chr, svStart, br[seed].chr2, svEnd, (bounds.ciposlow - svStart), (bounds.ciposhigh - svStart), (bounds.ciendlow - svEnd), (bounds.ciendhigh - svEnd), clique.size(), svInsLen, svt, svid));
 	// Reads assigned
 	for(typename TCliqueMembers::iterator itC = clique.begin(); itC != clique.end(); ++itC) br[*itC].svid = svid;
       }
@@ -340,101 +409,90 @@ namespace torali
   }
   
 
+  // Union-find root with path halving
+  inline uint32_t
+  _findRoot(std::vector<uint32_t>& parent, uint32_t v) {
+    while (parent[v] != v) {
+      parent[v] = parent[parent[v]];
+      v = parent[v];
+    }
+    return v;
+  }
+
   template<typename TConfig>
   inline void
   cluster(TConfig const& c, std::vector<SRBamRecord>& br, std::vector<StructuralVariantRecord>& sv, uint32_t const varisize, int32_t const svt) {
-    uint32_t count = 0;
-    for(int32_t refIdx = 0; refIdx < c.nchr; ++refIdx) {
-      
-      // Components
-      typedef std::vector<uint32_t> TComponent;
-      TComponent comp;
-      comp.resize(br.size(), 0);
-      uint32_t numComp = 0;
+    // Edge lists for each component
+    typedef uint32_t TWeightType;
+    typedef uint32_t TVertex;
+    typedef SREdgeRecord<TWeightType, TVertex> TEdgeRecord;
+    typedef std::vector<TEdgeRecord> TEdgeList;
+    typedef std::map<uint32_t, TEdgeList> TCompEdgeList;
+    TCompEdgeList compEdge;
 
-      // Edge lists for each component
-      typedef uint32_t TWeightType;
-      typedef uint32_t TVertex;
-      typedef SREdgeRecord<TWeightType, TVertex> TEdgeRecord;
-      typedef std::vector<TEdgeRecord> TEdgeList;
-      typedef std::map<uint32_t, TEdgeList> TCompEdgeList;
-      TCompEdgeList compEdge;
+    // Records are sorted by chromosome, each chromosome is a contiguous slice
+    uint32_t sliceEnd = 0;
+    for(uint32_t sliceStart = 0; sliceStart < br.size(); sliceStart = sliceEnd) {
+      for(sliceEnd = sliceStart + 1; ((sliceEnd < br.size()) && (br[sliceEnd].chr == br[sliceStart].chr)); ++sliceEnd);
 
+      // Union-find forest of the slice, component labels live at the root (0: no component)
+      uint32_t n = sliceEnd - sliceStart;
+      std::vector<uint32_t> parent(n);
+      for(uint32_t k = 0; k < n; ++k) parent[k] = k;
+      std::vector<uint32_t> label(n, 0);
+      uint32_t numComp = 0;
+      
+      uint32_t lastConnectedNode = 0;
+      for(uint32_t i = sliceStart; i < sliceEnd; ++i) {
+	// Safe to clean the graph?
+	if ((i > lastConnectedNode) && (!compEdge.empty())) {
+	  // Search cliques
+	  _searchCliques(compEdge, br, sv, varisize, svt);
+	  compEdge.clear();
+	}
 	
-      std::size_t lastConnectedNode = 0;
-      std::size_t lastConnectedNodeStart = 0;
-      for(uint32_t i = 0; i<br.size(); ++i) {
-	if (br[i].chr == refIdx) {
-	  ++count;
-	  // Safe to clean the graph?
-	  if (i > lastConnectedNode) {
-	    // Clean edge lists
-	    if (!compEdge.empty()) {
-	      // Search cliques
-	      _searchCliques(compEdge, br, sv, varisize, svt);
-	      lastConnectedNodeStart = lastConnectedNode;
-	      compEdge.clear();
+	for(uint32_t j = i + 1; j < sliceEnd; ++j) {
+	  if ( (uint32_t) (br[j].pos - br[i].pos) > varisize) break;
+	  if ( (uint32_t) std::abs(br[j].pos2 - br[i].pos2) < varisize) {
+	    // Update last connected node
+	    if (j > lastConnectedNode) lastConnectedNode = j;
+	    
+	    // Assign components, merged components keep the smaller label
+	    uint32_t ri = _findRoot(parent, i - sliceStart);
+	    uint32_t rj = _findRoot(parent, j - sliceStart);
+	    uint32_t compIndex = 0;
+	    if ((!label[ri]) && (!label[rj])) {
+	      compIndex = ++numComp;
+	      parent[rj] = ri;
+	      label[ri] = compIndex;
+	      compEdge.insert(std::make_pair(compIndex, TEdgeList()));
+	    } else if (!label[ri]) {
+	      parent[ri] = rj;
+	      compIndex = label[rj];
+	    } else if (!label[rj]) {
+	      parent[rj] = ri;
+	      compIndex = label[ri];
+	    } else if (ri == rj) {
+	      compIndex = label[ri];
+	    } else {
+	      compIndex = std::min(label[ri], label[rj]);
+	      uint32_t otherIndex = std::max(label[ri], label[rj]);
+	      if (label[ri] == compIndex) parent[rj] = ri;
+	      else parent[ri] = rj;
+	      // Merge edge lists, edges are sorted by weight before the clique search
+	      TCompEdgeList::iterator compEdgeIt = compEdge.find(compIndex);
+	      TCompEdgeList::iterator compEdgeOtherIt = compEdge.find(otherIndex);
+	      if (compEdgeIt->second.size() < compEdgeOtherIt->second.size()) compEdgeIt->second.swap(compEdgeOtherIt->second);
+	      compEdgeIt->second.insert(compEdgeIt->second.end(), compEdgeOtherIt->second.begin(), compEdgeOtherIt->second.end());
+	      compEdge.erase(compEdgeOtherIt);
 	    }
-	  }
-	  
-	  
-	  for(uint32_t j = i + 1; j<br.size(); ++j) {
-	    if (br[j].chr == refIdx) {
-	      if ( (uint32_t) (br[j].pos - br[i].pos) > varisize) break;
-	      if ( (uint32_t) std::abs(br[j].pos2 - br[i].pos2) < varisize) {
-		// Update last connected node
-		if (j > lastConnectedNode) lastConnectedNode = j;
-		
-		// Assign components
-		uint32_t compIndex = 0;
-		if (!comp[i]) {
-		  if (!comp[j]) {
-		    // Both vertices have no component
-		    compIndex = ++numComp;
-		    comp[i] = compIndex;
-		    comp[j] = compIndex;
-		    compEdge.insert(std::make_pair(compIndex, TEdgeList()));
-		  } else {
-		    compIndex = comp[j];
-		    comp[i] = compIndex;
-		  }	
-		} else {
-		  if (!comp[j]) {
-		    compIndex = comp[i];
-		    comp[j] = compIndex;
-		  } else {
-		    // Both vertices have a component
-		    if (comp[j] == comp[i]) {
-		      compIndex = comp[j];
-		    } else {
-		      // Merge components
-		      compIndex = comp[i];
-		      uint32_t otherIndex = comp[j];
-		      if (otherIndex < compIndex) {
-			compIndex = comp[j];
-			otherIndex = comp[i];
-		      }
-		      // Re-label other index
-		      for(uint32_t k = lastConnectedNodeStart; k <= lastConnectedNode; ++k) {
-			if (otherIndex == comp[k]) comp[k] = compIndex;
-		      }
-		      // Merge edge lists
-		      TCompEdgeList::iterator compEdgeIt = compEdge.find(compIndex);
-		      TCompEdgeList::iterator compEdgeOtherIt = compEdge.find(otherIndex);
-		      compEdgeIt->second.insert(compEdgeIt->second.end(), compEdgeOtherIt->second.begin(), compEdgeOtherIt->second.end());
-		      compEdge.erase(compEdgeOtherIt);
-		    }
-		  }
-		}
-		
-		// Append new edge
-		TCompEdgeList::iterator compEdgeIt = compEdge.find(compIndex);
-		if (compEdgeIt->second.size() < c.graphPruning) {
-		  // Breakpoint distance
-		  TWeightType weight = std::abs(br[j].pos2 - br[i].pos2) + std::abs(br[j].pos - br[i].pos);
-		  compEdgeIt->second.push_back(TEdgeRecord(i, j, weight));
-		}
-	      }
+	    
+	    // Append new edge
+	    TCompEdgeList::iterator compEdgeIt = compEdge.find(compIndex);
+	    if (compEdgeIt->second.size() < c.graphPruning) {
+	      // Breakpoint distance
+	      TWeightType weight = std::abs(br[j].pos2 - br[i].pos2) + std::abs(br[j].pos - br[i].pos);
+	      compEdgeIt->second.push_back(TEdgeRecord(i, j, weight));
 	    }
 	  }
 	}
@@ -448,82 +506,146 @@ namespace torali
   }
 
 
-  template<typename TCompEdgeList, typename TBamRecord, typename TSVs>
+  // Telemetry of one paired-end graph component
+  struct ComponentStats {
+    int32_t svt;
+    int32_t tid;
+    int32_t mtid;
+    int32_t start;
+    int32_t end;
+    uint32_t vertices;
+    uint32_t edges;
+    uint32_t pruned;
+    uint32_t svs;
+    uint64_t usec;
+
+    explicit ComponentStats(int32_t const s) : svt(s), tid(0), mtid(0), start(0), end(0), vertices(0), edges(0), pruned(0), svs(0), usec(0) {}
+  };
+
+  template<typename TEdgeList, typename TBamRecord>
   inline void
-  _searchCliques(TCompEdgeList& compEdge, TBamRecord const& bamRecord, TSVs& svs, int32_t const svt) {
-    typedef typename TCompEdgeList::mapped_type TEdgeList;
+  _componentSpan(TEdgeList const& edges, TBamRecord const& bamRecord, ComponentStats& cs) {
+    std::vector<std::size_t> vertex;
+    for(uint32_t e = 0; e < edges.size(); ++e) {
+      vertex.push_back(edges[e].source);
+      vertex.push_back(edges[e].target);
+    }
+    std::sort(vertex.begin(), vertex.end());
+    vertex.erase(std::unique(vertex.begin(), vertex.end()), vertex.end());
+    cs.vertices = vertex.size();
+    cs.edges = edges.size();
+    cs.tid = bamRecord[vertex[0]].tid;
+    cs.mtid = bamRecord[vertex[0]].mtid;
+    cs.start = _minCoord(bamRecord[vertex[0]].pos, bamRecord[vertex[0]].mpos, cs.svt);
+    cs.end = _maxCoord(bamRecord[vertex[0]].pos, bamRecord[vertex[0]].mpos, cs.svt);
+    for(uint32_t k = 1; k < vertex.size(); ++k) {
+      cs.start = std::min(cs.start, _minCoord(bamRecord[vertex[k]].pos, bamRecord[vertex[k]].mpos, cs.svt));
+      cs.end = std::max(cs.end, _maxCoord(bamRecord[vertex[k]].pos, bamRecord[vertex[k]].mpos, cs.svt));
+    }
+  }
+
+  // Subsample a dense component to the edges between its best mapped pairs, ties go to the lighter edges
+  template<typename TEdgeList, typename TBamRecord>
+  inline uint32_t
+  _pruneByMapQuality(TEdgeList& edges, TBamRecord const& bamRecord, uint32_t const maxEdges) {
+    typedef typename TEdgeList::value_type TEdgeRecord;
+    if (edges.size() <= maxEdges) return 0;
+    std::vector<uint8_t> qual(edges.size());
+    for(uint32_t e = 0; e < edges.size(); ++e) qual[e] = std::min(bamRecord[edges[e].source].MapQuality, bamRecord[edges[e].target].MapQuality);
+    std::vector<uint8_t> ranked(qual);
+    std::nth_element(ranked.begin(), ranked.begin() + maxEdges, ranked.end(), std::greater<uint8_t>());
+    uint8_t cutoff = ranked[maxEdges];
+    TEdgeList keep;
+    TEdgeList tie;
+    for(uint32_t e = 0; e < edges.size(); ++e) {
+      if (qual[e] > cutoff) keep.push_back(edges[e]);
+      else if (qual[e] == cutoff) tie.push_back(edges[e]);
+    }
+    std::sort(tie.begin(), tie.end(), SortEdgeRecords<TEdgeRecord>());
+    tie.resize(std::min(tie.size(), maxEdges - keep.size()), tie[0]);
+    keep.insert(keep.end(), tie.begin(), tie.end());
+    uint32_t pruned = edges.size() - keep.size();
+    edges.swap(keep);
+    return pruned;
+  }
+
+  template<typename TEdgeList, typename TBamRecord, typename TSVs>
+  inline void
+  _searchClique(TEdgeList& edges, TBamRecord const& bamRecord, TSVs& svs, int32_t const svt) {
     typedef typename TEdgeList::value_type TEdgeRecord;
 
+    // Sort edges by weight
+    std::sort(edges.begin(), edges.end(), SortEdgeRecords<TEdgeRecord>());
+    
+    // Find a large clique
+    std::size_t seed = edges.begin()->source;
+    int32_t clusterRefID=bamRecord[seed].tid;
+    int32_t clusterMateRefID=bamRecord[seed].mtid;
+    PECliqueBounds<TBamRecord> bounds(bamRecord, seed, svt);
+    if ((clusterRefID==clusterMateRefID) && (bounds.svStart >= bounds.svEnd)) return;
+    typedef std::vector<std::size_t> TCliqueMembers;
+    TCliqueMembers clique;
+    _growClique(edges, bounds, clique);
+    int32_t svStart = bounds.svStart;
+    int32_t svEnd = bounds.svEnd;
+    int32_t wiggle = bounds.wiggle;
+    
+    if ((clique.size()>1) && (_svSizeCheck(svStart, svEnd, svt))) {
+      StructuralVariantRecord svRec;
+      svRec.chr = clusterRefID;
+      svRec.chr2 = clusterMateRefID;
+      svRec.svStart = (uint32_t) svStart + 1;
+      svRec.svEnd = (uint32_t) svEnd + 1;
+      svRec.peSupport = clique.size();
+      int32_t ci_wiggle = std::max(abs(wiggle), 50);
+      svRec.ciposlow = -ci_wiggle;
+      svRec.ciposhigh = ci_wiggle;
+      svRec.ciendlow = -ci_wiggle;
+      svRec.ciendhigh = ci_wiggle;
+      std::vector<uint8_t> mapQV;
+      for(typename TCliqueMembers::const_iterator itC = clique.begin(); itC!=clique.end(); ++itC) mapQV.push_back(bamRecord[*itC].MapQuality);
+      std::sort(mapQV.begin(), mapQV.end());
+      svRec.peMapQuality = mapQV[mapQV.size()/2];
+      svRec.srSupport=0;
+      svRec.srAlignQuality=0;
+      svRec.precise=false;
+      svRec.svt = svt;
+      svRec.insLen = 0;
+      svRec.homLen = 0;
+      svs.push_back(svRec);
+    }
+  }
+
+  template<typename TConfig, typename TCompEdgeList, typename TPruned, typename TBamRecord, typename TSVs>
+  inline void
+  _searchCliques(TConfig const& c, TCompEdgeList& compEdge, TPruned const& compPruned, TBamRecord const& bamRecord, TSVs& svs, int32_t const svt, std::vector<ComponentStats>& stats) {
     // Iterate all components
     for(typename TCompEdgeList::iterator compIt = compEdge.begin(); compIt != compEdge.end(); ++compIt) {
-      // Sort edges by weight
-      std::sort(compIt->second.begin(), compIt->second.end(), SortEdgeRecords<TEdgeRecord>());
-      
-      // Find a large clique
-      typename TEdgeList::const_iterator itWEdge = compIt->second.begin();
-      typename TEdgeList::const_iterator itWEdgeEnd = compIt->second.end();
-      typedef std::set<std::size_t> TCliqueMembers;
-      
-      TCliqueMembers clique;
-      TCliqueMembers incompatible;
-      int32_t svStart = -1;
-      int32_t svEnd = -1;
-      int32_t wiggle = 0;
-      int32_t clusterRefID=bamRecord[itWEdge->source].tid;
-      int32_t clusterMateRefID=bamRecord[itWEdge->source].mtid;
-      _initClique(bamRecord[itWEdge->source], svStart, svEnd, wiggle, svt);
-      if ((clusterRefID==clusterMateRefID) && (svStart >= svEnd))  continue;
-      clique.insert(itWEdge->source);
-      
-      // Grow the clique from the seeding edge
-      bool cliqueGrow=true;
-      while (cliqueGrow) {
-	itWEdge = compIt->second.begin();
-	cliqueGrow = false;
-	for(;(!cliqueGrow) && (itWEdge != itWEdgeEnd);++itWEdge) {
-	  std::size_t v;
-	  if ((clique.find(itWEdge->source) == clique.end()) && (clique.find(itWEdge->target) != clique.end())) v = itWEdge->source;
-	  else if ((clique.find(itWEdge->source) != clique.end()) && (clique.find(itWEdge->target) == clique.end())) v = itWEdge->target;
-	  else continue;
-	  if (incompatible.find(v) != incompatible.end()) continue;
-	  cliqueGrow = _updateClique(bamRecord[v], svStart, svEnd, wiggle, svt);
-	  if (cliqueGrow) clique.insert(v);
-	  else incompatible.insert(v);
-	}
+      if (compIt->second.empty()) continue;
+      boost::posix_time::ptime start;
+      ComponentStats cs(svt);
+      if (c.hasClusterStats) {
+	start = boost::posix_time::microsec_clock::local_time();
+	_componentSpan(compIt->second, bamRecord, cs);
+	typename TPruned::const_iterator itPruned = compPruned.find(compIt->first);
+	if (itPruned != compPruned.end()) cs.pruned = itPruned->second;
       }
-      
-      if ((clique.size()>1) && (_svSizeCheck(svStart, svEnd, svt))) {
-	StructuralVariantRecord svRec;
-	svRec.chr = clusterRefID;
-	svRec.chr2 = clusterMateRefID;
-	svRec.svStart = (uint32_t) svStart + 1;
-	svRec.svEnd = (uint32_t) svEnd + 1;
-	svRec.peSupport = clique.size();
-	int32_t ci_wiggle = std::max(abs(wiggle), 50);
-	svRec.ciposlow = -ci_wiggle;
-	svRec.ciposhigh = ci_wiggle;
-	svRec.ciendlow = -ci_wiggle;
-	svRec.ciendhigh = ci_wiggle;
-	std::vector<uint8_t> mapQV;
-	for(typename TCliqueMembers::const_iterator itC = clique.begin(); itC!=clique.end(); ++itC) mapQV.push_back(bamRecord[*itC].MapQuality);
-	std::sort(mapQV.begin(), mapQV.end());
-	svRec.peMapQuality = mapQV[mapQV.size()/2];
-	svRec.srSupport=0;
-	svRec.srAlignQuality=0;
-	svRec.precise=false;
-	svRec.svt = svt;
-	svRec.insLen = 0;
-	svRec.homLen = 0;
-	svs.push_back(svRec);
+      if (c.adaptivePruning) cs.pruned += _pruneByMapQuality(compIt->second, bamRecord, c.graphPruning);
+      std::size_t found = svs.size();
+      _searchClique(compIt->second, bamRecord, svs, svt);
+      if (c.hasClusterStats) {
+	cs.svs = svs.size() - found;
+	cs.usec = (boost::posix_time::microsec_clock::local_time() - start).total_microseconds();
+	stats.push_back(cs);
       }
     }
   }
   
   
 
-  template<typename TConfig>
+  template<typename TConfig, typename TSampleLib>
   inline void
-  cluster(TConfig const& c, std::vector<BamAlignRecord>& bamRecord, std::vector<StructuralVariantRecord>& svs, uint32_t const varisize, int32_t const svt) {
+  cluster(TConfig const& c, std::vector<BamAlignRecord>& bamRecord, std::vector<StructuralVariantRecord>& svs, TSampleLib const& sampleLib, uint32_t const varisize, int32_t const svt, std::vector<ComponentStats>& stats) {
     typedef typename std::vector<BamAlignRecord> TBamRecord;
     // Components
     typedef std::vector<uint32_t> TComponent;
@@ -537,6 +659,12 @@ namespace torali
     typedef std::vector<TEdgeRecord> TEdgeList;
     typedef std::map<uint32_t, TEdgeList> TCompEdgeList;
     TCompEdgeList compEdge;
+
+    // Edges dropped per component, the adaptive mode collects more edges and subsamples by mapping quality
+    typedef std::map<uint32_t, uint32_t> TCompPruned;
+    TCompPruned compPruned;
+    uint32_t edgeCap = c.graphPruning;
+    if (c.adaptivePruning) edgeCap = DELLY_ADAPTIVE_PRUNING * c.graphPruning;
     
     // Iterate the chromosome range
     std::size_t lastConnectedNode = 0;
@@ -547,9 +675,10 @@ namespace torali
       if (bamItIndex > lastConnectedNode) {
 	// Clean edge lists
 	if (!compEdge.empty()) {
-	  _searchCliques(compEdge, bamRecord, svs, svt);
+	  _searchCliques(c, compEdge, compPruned, bamRecord, svs, svt, stats);
 	  lastConnectedNodeStart = lastConnectedNode;
 	  compEdge.clear();
+	  compPruned.clear();
 	}
       }
       int32_t const minCoord = _minCoord(bamIt->pos, bamIt->mpos, svt);
@@ -562,7 +691,7 @@ namespace torali
 	if (bamIt->mtid != bamItNext->mtid) continue;
 	
 	// Check combinability of pairs
-	if (_pairsDisagree(minCoord, maxCoord, bamIt->alen, bamIt->maxNormalISize, _minCoord(bamItNext->pos, bamItNext->mpos, svt), _maxCoord(bamItNext->pos, bamItNext->mpos, svt), bamItNext->alen, bamItNext->maxNormalISize, svt)) continue;
+	if (_pairsDisagree(minCoord, maxCoord, (int32_t) bamIt->alen, bamIt->maxNormalISize, _minCoord(bamItNext->pos, bamItNext->mpos, svt), _maxCoord(bamItNext->pos, bamItNext->mpos, svt), (int32_t) bamItNext->alen, bamItNext->maxNormalISize, svt)) continue;
 	
 	// Update last connected node
 	if (bamItIndexNext > lastConnectedNode ) lastConnectedNode = bamItIndexNext;
@@ -605,20 +734,27 @@ namespace torali
 	      TCompEdgeList::iterator compEdgeOtherIt = compEdge.find(otherIndex);
 	      compEdgeIt->second.insert(compEdgeIt->second.end(), compEdgeOtherIt->second.begin(), compEdgeOtherIt->second.end());
 	      compEdge.erase(compEdgeOtherIt);
+	      TCompPruned::iterator itPruned = compPruned.find(otherIndex);
+	      if (itPruned != compPruned.end()) {
+		compPruned[compIndex] += itPruned->second;
+		compPruned.erase(itPruned);
+	      }
 	    }
 	  }
 	}
 	
 	// Append new edge
 	TCompEdgeList::iterator compEdgeIt = compEdge.find(compIndex);
-	if (compEdgeIt->second.size() < c.graphPruning) {
-	  TWeightType weight = (TWeightType) ( std::log((double) abs( abs( (_minCoord(bamItNext->pos, bamItNext->mpos, svt) - minCoord) - (_maxCoord(bamItNext->pos, bamItNext->mpos, svt) - maxCoord) ) - abs(bamIt->Median - bamItNext->Median)) + 1) / std::log(2) );
+	if (compEdgeIt->second.size() >= edgeCap) {
+	  if (c.hasClusterStats) ++compPruned[compIndex];
+	} else {
+	  TWeightType weight = (TWeightType) ( std::log((double) abs( abs( (_minCoord(bamItNext->pos, bamItNext->mpos, svt) - minCoord) - (_maxCoord(bamItNext->pos, bamItNext->mpos, svt) - maxCoord) ) - abs(sampleLib[bamIt->lib].median - sampleLib[bamItNext->lib].median)) + 1) / std::log(2) );
 	  compEdgeIt->second.push_back(TEdgeRecord(bamItIndex, bamItIndexNext, weight));
 	}
       }
     }
     if (!compEdge.empty()) {
-      _searchCliques(compEdge, bamRecord, svs, svt);
+      _searchCliques(c, compEdge, compPruned, bamRecord, svs, svt, stats);
       compEdge.clear();
     }
   }
@@ -37,6 +37,8 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include "util.h"
 #include "msa.h"
 #include "split.h"
+#include "matetable.h"
+#include "refcache.h"
 
 
 namespace torali {
@@ -132,6 +134,34 @@ namespace torali {
     return (baseQualSum / alignedBases);
   }
 
+  // Same as _getAlignmentQual for the reverse trace of s1 and s2, without building the alignment
+  template<typename TQualities>
+  inline uint32_t
+  _getTraceQual(std::vector<char> const& trace, std::string const& s1, std::string const& s2, TQualities const& qual) {
+    uint32_t baseQualSum = 0;
+    uint32_t seqPtr = 0;
+    uint32_t alignedBases = 0;
+    std::size_t row = 0;
+    std::size_t col = 0;
+    for(std::vector<char>::const_reverse_iterator itT = trace.rbegin(); itT != trace.rend(); ++itT) {
+      char c1 = '-';
+      char c2 = '-';
+      if (*itT == 's') {
+	c1 = s1[row++];
+	c2 = s2[col++];
+      } else if (*itT == 'h') c2 = s2[col++];
+      else c1 = s1[row++];
+      if (c2 != '-') {
+	if (c1 != '-') {
+	  ++alignedBases;
+	  baseQualSum += qual[seqPtr];
+	}
+	++seqPtr;
+      }
+    }
+    return (baseQualSum / alignedBases);
+  }
+
   template<typename TPos>
   inline int32_t
   _cutRefStart(TPos const rStart, TPos const rEnd, TPos const offset, unsigned int bpPoint, int32_t const svt) {
@@ -182,7 +212,7 @@ namespace torali {
 
 template<typename TConfig, typename TSampleLibrary, typename TCovRecord, typename TCoverageCount, typename TSVs, typename TCountMap, typename TSpanMap>
 inline void
-annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCoverageCount& covCount, TSVs& svs, TCountMap& countMap, TSpanMap& spanMap)
+annotateCoverage(TConfig& c, ReferenceCache& ref, TSampleLibrary& sampleLib, TCovRecord& ict, TCoverageCount& covCount, TSVs& svs, TCountMap& countMap, TSpanMap& spanMap)
 {
   typedef typename TSpanMap::value_type::value_type TSpanPair;
   typedef typename TCountMap::value_type::value_type TCountPair;
@@ -198,6 +228,7 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
   int32_t totalTarget = 0;
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
     samfile[file_c] = sam_open(c.files[file_c].string().c_str(), "r");
+    _attachThreadPool(samfile[file_c], c.tpool);
     hts_set_fai_filename(samfile[file_c], c.genome.string().c_str());
     idx[file_c] = sam_index_load(samfile[file_c], c.files[file_c].string().c_str());
     hdr[file_c] = sam_hdr_read(samfile[file_c]);
@@ -250,10 +281,10 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
   // Iterate all structural variants
   {
     TProbes refProbes(svs.size());
-    faidx_t* fai = fai_load(c.genome.string().c_str());
     for(int32_t refIndex=0; refIndex < (int32_t) hdr[0]->n_targets; ++refIndex) {
       ++show_progresss;
-      char* seq = NULL;
+      ReferenceCache::TContig contig;
+      char const* seq = NULL;
 
       // Iterate all structural variants
       for(typename TSVs::iterator itSV = svs.begin(); itSV != svs.end(); ++itSV) {
@@ -262,8 +293,8 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
 	// Lazy loading of reference sequence
 	if (seq == NULL) {
 	  int32_t seqlen = -1;
-	  std::string tname(hdr[0]->target_name[refIndex]);
-	  seq = faidx_fetch_seq(fai, tname.c_str(), 0, hdr[0]->target_len[refIndex], &seqlen);
+	  contig = _fetchContig(ref, std::string(hdr[0]->target_name[refIndex]), seqlen);
+	  seq = contig.get();
 	}
 
 	// Set tag alleles
@@ -327,10 +358,8 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
 	  }
 	}
       }
-      if (seq != NULL) free(seq);
     }
     // Clean-up
-    fai_destroy(fai);
     for(int32_t refIndex=0; refIndex < (int32_t) hdr[0]->n_targets; ++refIndex) {
       // Sort breakpoint regions
       std::sort(bpRegion[refIndex].begin(), bpRegion[refIndex].end(), SortBp<BpRegion>());
@@ -359,12 +388,13 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
 #pragma omp parallel for default(shared)
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
     // Pair qualities and features
-    typedef boost::unordered_map<std::size_t, uint8_t> TQualities;
+    typedef std::pair<uint8_t, bool> TQualClip;
+    typedef MateTable<TQualClip> TQualities;
     TQualities qualities;
     TQualities qualitiestra;
-    typedef boost::unordered_map<std::size_t, bool> TClip;
-    TClip clip;
-    TClip cliptra;
+
+    // Alignment buffers reused across reads
+    AlignWorkspace ws;
   
     // Iterate chromosomes
     for(int32_t refIndex=0; refIndex < (int32_t) hdr[file_c]->n_targets; ++refIndex) {
@@ -474,28 +504,25 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
 	    for(; ((itBp != bpRegion[refIndex].end()) && (rec->core.pos + rec->core.l_qseq >= itBp->bppos)); ++itBp) {
 	      // Read spans breakpoint?
 	      if ((hasSoftClip) || ((!hasClip) && (rec->core.pos + c.minimumFlankSize + itBp->homLeft <= itBp->bppos) &&  (rec->core.pos + rec->core.l_qseq >= itBp->bppos + c.minimumFlankSize + itBp->homRight))) {
-		std::string consProbe = consProbeArr[itBp->bpPoint][itBp->id];
-		std::string refProbe = refProbeArr[itBp->bpPoint][itBp->id];
+		std::string const& consProbe = consProbeArr[itBp->bpPoint][itBp->id];
+		std::string const& refProbe = refProbeArr[itBp->bpPoint][itBp->id];
 
 		// Get sequence
-		std::string sequence;
+		std::string& sequence = ws.sequence;
 		sequence.resize(rec->core.l_qseq);
 		uint8_t* seqptr = bam_get_seq(rec);
 		for (int i = 0; i < rec->core.l_qseq; ++i) sequence[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, i)];
 		_adjustOrientation(sequence, itBp->bpPoint, itBp->svt);
 		
-		// Compute alignment to alternative haplotype
-		typedef boost::multi_array<char, 2> TAlign;
-		TAlign alignAlt;
+		// Score alignment to alternative haplotype, traceback only for the supported haplotype
 		DnaScore<int> simple(5, -4, -4, -4);
 		AlignConfig<true, false> semiglobal;
-		int32_t scoreA = needle(consProbe, sequence, alignAlt, semiglobal, simple);
+		int32_t scoreA = semiglobalScore(consProbe, sequence, simple, ws);
 		int32_t scoreAltThreshold = (int32_t) (c.flankQuality * consProbe.size() * simple.match + (1.0 - c.flankQuality) * consProbe.size() * simple.mismatch);
 		double scoreAlt = (double) scoreA / (double) scoreAltThreshold;
 		
-		// Compute alignment to reference haplotype
-		TAlign alignRef;
-		int32_t scoreR = needle(refProbe, sequence, alignRef, semiglobal, simple);
+		// Score alignment to reference haplotype
+		int32_t scoreR = semiglobalScore(refProbe, sequence, simple, ws);
 		int32_t scoreRefThreshold = (int32_t) (c.flankQuality * refProbe.size() * simple.match + (1.0 - c.flankQuality) * refProbe.size() * simple.mismatch);
 		double scoreRef = (double) scoreR / (double) scoreRefThreshold;
 
@@ -515,11 +542,12 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
 		  if (scoreRef > scoreAlt) {
 		    // Account for reference bias
 		    if (++refAlignedReadCount[file_c][itBp->id] % 2) {
-		      TQuality quality;
+		      TQuality& quality = ws.quality;
 		      quality.resize(rec->core.l_qseq);
 		      uint8_t* qualptr = bam_get_qual(rec);
 		      for (int i = 0; i < rec->core.l_qseq; ++i) quality[i] = qualptr[i];
-		      uint32_t rq = _getAlignmentQual(alignRef, quality);
+		      _needleTrace(refProbe, sequence, semiglobal, simple, ws);
+		      uint32_t rq = _getTraceQual(ws.trace, refProbe, sequence, quality);
 		      if (rq >= c.minGenoQual) {
 			uint8_t* hpptr = bam_aux_get(rec, "HP");
 #pragma omp critical
@@ -535,11 +563,12 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
 		      }
 		    }
 		  } else {
-		    TQuality quality;
+		    TQuality& quality = ws.quality;
 		    quality.resize(rec->core.l_qseq);
 		    uint8_t* qualptr = bam_get_qual(rec);
 		    for (int i = 0; i < rec->core.l_qseq; ++i) quality[i] = qualptr[i];
-		    uint32_t aq = _getAlignmentQual(alignAlt, quality);
+		    _needleTrace(consProbe, sequence, semiglobal, simple, ws);
+		    uint32_t aq = _getTraceQual(ws.trace, consProbe, sequence, quality);
 		    if (aq >= c.minGenoQual) {
 		      uint8_t* hpptr = bam_aux_get(rec, "HP");
 #pragma omp critical
@@ -580,31 +609,17 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
 	  // First read
 	  lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
 	  std::size_t hv = hash_pair(rec);
-	  if (rec->core.tid == rec->core.mtid) {
-	    qualities[hv] = rec->core.qual;
-	    clip[hv] = hasSoftClip;
-	  } else {
-	    qualitiestra[hv] = rec->core.qual;
-	    cliptra[hv] = hasSoftClip;
-	  }
+	  TQualities& qt = (rec->core.tid == rec->core.mtid) ? qualities : qualitiestra;
+	  _mateInsert(qt, hv, rec->core.mtid, rec->core.mpos, std::make_pair((uint8_t) rec->core.qual, hasSoftClip), rec->core.tid, rec->core.pos);
 	} else {
 	  // Second read
 	  std::size_t hv = hash_pair_mate(rec);
-	  uint8_t pairQuality = 0;
-	  bool pairClip = false;
-	  if (rec->core.tid == rec->core.mtid) {
-	    if (qualities.find(hv) == qualities.end()) continue; // Mate discarded
-	    pairQuality = std::min((uint8_t) qualities[hv], (uint8_t) rec->core.qual);
-	    if ((clip[hv]) || (hasSoftClip)) pairClip = true;
-	    qualities[hv] = 0;
-	    clip[hv] = false;
-	  } else {
-	    if (qualitiestra.find(hv) == qualitiestra.end()) continue; // Mate discarded
-	    pairQuality = std::min((uint8_t) qualitiestra[hv], (uint8_t) rec->core.qual);
-	    if ((cliptra[hv]) || (hasSoftClip)) pairClip = true;
-	    qualitiestra[hv] = 0;
-	    cliptra[hv] = false;
-	  }
+	  TQualities& qt = (rec->core.tid == rec->core.mtid) ? qualities : qualitiestra;
+	  TQualClip* mate = _mateFind(qt, hv);
+	  if (mate == NULL) continue; // Mate discarded
+	  uint8_t pairQuality = std::min((uint8_t) mate->first, (uint8_t) rec->core.qual);
+	  bool pairClip = ((mate->second) || (hasSoftClip));
+	  _mateErase(qt, hv);
 
 	  // Pair quality
 	  if (pairQuality < c.minGenoQual) continue; // Low quality pair
@@ -711,8 +726,7 @@ annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TCovRecord& ict, TCovera
       // Clean-up
       bam_destroy1(rec);
       hts_itr_destroy(iter);
-      qualities.clear();
-      clip.clear();
+      _mateClear(qualities);
 
       // Assign fragment and base counts to SVs
       for(uint32_t i = 0; i < ict[refIndex].size(); ++i) {
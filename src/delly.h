@@ -75,18 +75,23 @@ struct Config {
   uint16_t minTraQual;
   uint16_t minGenoQual;
   uint16_t madCutoff;
+  uint16_t threads;
   int32_t nchr;
   int32_t minimumFlankSize;
   int32_t indelsize;
   uint32_t graphPruning;
   uint32_t minRefSep;
   uint32_t maxReadSep;
+  uint32_t maxMemory;
+  uint32_t refCache;
   uint32_t minClip;
   float flankQuality;
   bool hasExcludeFile;
   bool hasVcfFile;
   bool isHaplotagged;
   bool dumpflag;
+  bool hasClusterStats;
+  bool adaptivePruning;
   bool svtcmd;
   std::set<int32_t> svtset;
   DnaScore<int> aliscore;
@@ -95,21 +100,19 @@ struct Config {
   boost::filesystem::path genome;
   boost::filesystem::path exclude;
   boost::filesystem::path srpedump;
+  boost::filesystem::path clusterStats;
+  boost::filesystem::path nmask;
   std::vector<boost::filesystem::path> files;
   std::vector<std::string> sampleName;
+  htsThreadPool* tpool;
 };
 
 
 
 template<typename TConfig, typename TSampleLib, typename TSVs, typename TCountMap, typename TSampleSVJunctionMap, typename TSpanningCoverage>
 inline void
-_annotateCoverage(TConfig& c, bam_hdr_t* hdr, TSampleLib& sampleLib, TSVs& svs, TCountMap& countMap, TSampleSVJunctionMap& juncMap, TSpanningCoverage& spanMap) 
+_annotateCoverage(TConfig& c, bam_hdr_t* hdr, ReferenceCache& ref, TSampleLib& sampleLib, TSVs& svs, TCountMap& countMap, TSampleSVJunctionMap& juncMap, TSpanningCoverage& spanMap) 
 {
-  // Find Ns in the reference genome
-  typedef boost::icl::interval_set<int> TNIntervals;
-  typedef std::vector<TNIntervals> TNGenome;
-  TNGenome ni( hdr->n_targets );
-
   // Find valid chromosomes
   typedef std::vector<bool> TValidChr;
   TValidChr validChr(hdr->n_targets, false);
@@ -118,33 +121,18 @@ _annotateCoverage(TConfig& c, bam_hdr_t* hdr, TSampleLib& sampleLib, TSVs& svs,
     validChr[itSV->chr2] = true;
   }
 
-  // Parse Ns
-  faidx_t* fai = fai_load(c.genome.string().c_str());
+  // Find Ns in the reference genome
+  std::vector<std::string> names;
   for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) {
-    if (!validChr[refIndex]) continue;
-    std::string tname(hdr->target_name[refIndex]);
-    int32_t seqlen = -1;
-    char* seq = NULL;
-    seq = faidx_fetch_seq(fai, tname.c_str(), 0, hdr->target_len[refIndex], &seqlen);
-    bool nrun = false;
-    int nstart = seqlen;
-    for(int i=0; i<seqlen; ++i) {
-      if ((seq[i] != 'n') && (seq[i] != 'N')) {
-	if (nrun) {
-	  ni[refIndex].add(boost::icl::discrete_interval<int>::right_open(nstart,i));
-	  nrun = false;
-	}
-      } else {
-	if (!nrun) {
-	  nrun = true;
-	  nstart = i;
-	}
-      }
-    }
-    if (nrun) ni[refIndex].add(boost::icl::discrete_interval<int>::right_open(nstart,seqlen));
-    if (seq != NULL) free(seq);
+    if (validChr[refIndex]) names.push_back(std::string(hdr->target_name[refIndex]));
   }
-  fai_destroy(fai);
+  TNMask mask;
+  _loadOrBuildNMask(ref, c.genome, c.nmask, names, mask);
+  std::vector<TNRuns> ni(hdr->n_targets);
+  for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) {
+    if (validChr[refIndex]) ni[refIndex].swap(mask[std::string(hdr->target_name[refIndex])]);
+  }
+  mask.clear();
   
   // Add control regions
   typedef std::vector<CovRecord> TCovRecord;
@@ -162,11 +150,11 @@ _annotateCoverage(TConfig& c, bam_hdr_t* hdr, TSampleLib& sampleLib, TSVs& svs,
     sLeft.id = lastId + itSV->id;
     sLeft.svStart = std::max(itSV->svStart - halfSize, 0);
     sLeft.svEnd = itSV->svStart;
-    typename TNIntervals::const_iterator itO = ni[itSV->chr].find(boost::icl::discrete_interval<int>::right_open(sLeft.svStart, sLeft.svEnd));
-    while (itO != ni[itSV->chr].end()) {
-      sLeft.svStart = std::max(itO->lower() - halfSize, 0);
-      sLeft.svEnd = itO->lower();
-      itO = ni[itSV->chr].find(boost::icl::discrete_interval<int>::right_open(sLeft.svStart, sLeft.svEnd));
+    std::pair<int32_t, int32_t> const* itO = _findNRun(ni[itSV->chr], sLeft.svStart, sLeft.svEnd);
+    while (itO != NULL) {
+      sLeft.svStart = std::max(itO->first - halfSize, 0);
+      sLeft.svEnd = itO->first;
+      itO = _findNRun(ni[itSV->chr], sLeft.svStart, sLeft.svEnd);
     }
     svc[itSV->chr].push_back(sLeft);
 
@@ -189,11 +177,11 @@ _annotateCoverage(TConfig& c, bam_hdr_t* hdr, TSampleLib& sampleLib, TSVs& svs,
     sRight.id = 2 * lastId + itSV->id;
     sRight.svStart = itSV->svEnd;
     sRight.svEnd = itSV->svEnd + halfSize;
-    itO = ni[itSV->chr2].find(boost::icl::discrete_interval<int>::right_open(sRight.svStart, sRight.svEnd));
-    while (itO != ni[itSV->chr2].end()) {
-      sRight.svStart = itO->upper();
-      sRight.svEnd = itO->upper() + halfSize;
-      itO = ni[itSV->chr2].find(boost::icl::discrete_interval<int>::right_open(sRight.svStart, sRight.svEnd));
+    itO = _findNRun(ni[itSV->chr2], sRight.svStart, sRight.svEnd);
+    while (itO != NULL) {
+      sRight.svStart = itO->second;
+      sRight.svEnd = itO->second + halfSize;
+      itO = _findNRun(ni[itSV->chr2], sRight.svStart, sRight.svEnd);
     }
     svc[itSV->chr2].push_back(sRight);
     //std::cerr << itSV->id << ':' << sLeft.svStart << '-' << sLeft.svEnd << ',' << itSV->svStart << '-' << itSV->svEnd << ',' << sRight.svStart << '-' << sRight.svEnd << std::endl;
@@ -203,7 +191,7 @@ _annotateCoverage(TConfig& c, bam_hdr_t* hdr, TSampleLib& sampleLib, TSVs& svs,
   typedef std::vector<TBpRead> TSVReadCount;
   typedef std::vector<TSVReadCount> TSampleSVReadCount;
   TSampleSVReadCount readCountMap;
-  annotateCoverage(c, sampleLib, svc, readCountMap, svs, juncMap, spanMap);
+  annotateCoverage(c, ref, sampleLib, svc, readCountMap, svs, juncMap, spanMap);
   countMap.resize(c.files.size());
   for(uint32_t file_c = 0; file_c < c.files.size(); ++file_c) {
     countMap[file_c].resize(svs.size());
@@ -311,14 +299,20 @@ inline int dellyRun(TConfigStruct& c) {
 
   // Open header
   samFile* samfile = sam_open(c.files[0].string().c_str(), "r");
+  _attachThreadPool(samfile, c.tpool);
   bam_hdr_t* hdr = sam_hdr_read(samfile);
 
+  // Reference genome, shared by all stages
+  ReferenceCache ref;
+  _openReference(ref, c.genome, (uint64_t) c.refCache * 1024 * 1024);
+
   // Exclude intervals
   typedef boost::icl::interval_set<uint32_t> TChrIntervals;
   typedef std::vector<TChrIntervals> TRegionsGenome;
   TRegionsGenome validRegions;
   if (!_parseExcludeIntervals(c, hdr, validRegions)) {
     std::cerr << "Delly couldn't parse excluce intervals!" << std::endl;
+    _closeReference(ref);
     bam_hdr_destroy(hdr);
     sam_close(samfile);
     return 1;
@@ -338,6 +332,7 @@ inline int dellyRun(TConfigStruct& c) {
   for(uint32_t i = 0; i<sampleLib.size(); ++i) {
     if (sampleLib[i].rs == 0) {
       std::cerr << "Sample has not enough data to estimate library parameters! File: " << c.files[i].string() << std::endl;
+      _closeReference(ref);
       bam_hdr_destroy(hdr);
       sam_close(samfile);
       return 1;
@@ -356,15 +351,43 @@ inline int dellyRun(TConfigStruct& c) {
       typedef boost::unordered_map<TPosRead, int32_t> TPosReadSV;
       typedef std::vector<TPosReadSV> TGenomicPosReadSV;
       TGenomicPosReadSV srStore(c.nchr, TPosReadSV());
-      scanPEandSR(c, validRegions, svs, srSVs, srStore, sampleLib);
+
+      // Split-read cache and junctions of unresolved read groups, one spill file per sample
+      ReadCache rc;
+      ReadCache jc;
+      if ((!_openReadCache(rc, c.files.size())) || (!_openReadCache(jc, c.files.size()))) {
+	std::cerr << "Delly couldn't create the split-read cache!" << std::endl;
+	_closeReadCache(rc);
+	_closeReadCache(jc);
+	_closeReference(ref);
+	bam_hdr_destroy(hdr);
+	sam_close(samfile);
+	return 1;
+      }
+      if (!scanPEandSR(c, validRegions, svs, srSVs, srStore, sampleLib, rc, jc)) {
+	_closeReadCache(rc);
+	_closeReadCache(jc);
+	_closeReference(ref);
+	bam_hdr_destroy(hdr);
+	sam_close(samfile);
+	return 1;
+      }
+      _closeReadCache(jc);
 
       // Assemble split-read calls
-      assembleSplitReads(c, validRegions, srStore, srSVs);
+      if (!assembleSplitReads(c, validRegions, srStore, rc, ref, srSVs)) {
+	_closeReadCache(rc);
+	_closeReference(ref);
+	bam_hdr_destroy(hdr);
+	sam_close(samfile);
+	return 1;
+      }
+      _closeReadCache(rc);
     }
 
     // Sort and merge PE and SR calls
     mergeSort(svs, srSVs);
-  } else vcfParse(c, hdr, svs);
+  } else vcfParse(c, hdr, ref, svs);
 
   // Re-number SVs
   sort(svs.begin(), svs.end(), SortSVs<StructuralVariantRecord>());    
@@ -387,12 +410,13 @@ inline int dellyRun(TConfigStruct& c) {
   TSampleSVReadCount rcMap;
 
   // SV Genotyping
-  if (!svs.empty()) _annotateCoverage(c, hdr, sampleLib, svs, rcMap, junctionCountMap, spanCountMap);
+  if (!svs.empty()) _annotateCoverage(c, hdr, ref, sampleLib, svs, rcMap, junctionCountMap, spanCountMap);
   
   // VCF output
   vcfOutput(c, svs, junctionCountMap, rcMap, spanCountMap);
 
   // Clean-up
+  _closeReference(ref);
   bam_hdr_destroy(hdr);
   sam_close(samfile);
 
@@ -427,6 +451,8 @@ int delly(int argc, char **argv) {
     ("genome,g", boost::program_options::value<boost::filesystem::path>(&c.genome), "genome fasta file")
     ("exclude,x", boost::program_options::value<boost::filesystem::path>(&c.exclude), "file with regions to exclude")
     ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("sv.bcf"), "SV BCF output file")
+    ("threads", boost::program_options::value<uint16_t>(&c.threads)->default_value(1), "BGZF/CRAM (de)compression threads")
+    ("max-memory", boost::program_options::value<uint32_t>(&c.maxMemory)->default_value(0), "max. memory in MB for sorted PE and SR records each, 0: no limit")
     ;
 
   boost::program_options::options_description disc("Discovery options");
@@ -444,6 +470,7 @@ int delly(int argc, char **argv) {
     ("vcffile,v", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file for genotyping")
     ("geno-qual,u", boost::program_options::value<uint16_t>(&c.minGenoQual)->default_value(5), "min. mapping quality for genotyping")
     ("dump,d", boost::program_options::value<boost::filesystem::path>(&c.srpedump), "gzipped output file for SV-reads (optional)")
+    ("nmask", boost::program_options::value<boost::filesystem::path>(&c.nmask), "reference N-mask cache, created or extended if needed (optional)")
     ;
 
   // Define hidden options
@@ -451,6 +478,9 @@ int delly(int argc, char **argv) {
   hidden.add_options()
     ("input-file", boost::program_options::value< std::vector<boost::filesystem::path> >(&c.files), "input file")
     ("pruning,j", boost::program_options::value<uint32_t>(&c.graphPruning)->default_value(1000), "PE graph pruning cutoff")
+    ("adaptive-pruning", "subsample pruned PE components by mapping quality")
+    ("ref-cache", boost::program_options::value<uint32_t>(&c.refCache)->default_value(2048), "max. memory in MB for decoded reference contigs")
+    ("cluster-stats", boost::program_options::value<boost::filesystem::path>(&c.clusterStats), "PE graph component statistics (TSV)")
     ;
 
   boost::program_options::positional_options_description pos_args;
@@ -512,6 +542,10 @@ int delly(int argc, char **argv) {
   // Dump PE and SR support?
   if (vm.count("dump")) c.dumpflag = true;
   else c.dumpflag = false;
+  if (vm.count("cluster-stats")) c.hasClusterStats = true;
+  else c.hasClusterStats = false;
+  if (vm.count("adaptive-pruning")) c.adaptivePruning = true;
+  else c.adaptivePruning = false;
 
   // Check quality cuts
   if (c.minMapQual > c.minTraQual) c.minTraQual = c.minMapQual;
@@ -532,44 +566,57 @@ int delly(int argc, char **argv) {
   }
 
   // Check input files
+  if (c.files.size() > 65535) {
+    std::cerr << "Delly supports at most 65535 input samples per run!" << std::endl;
+    return 1;
+  }
   c.sampleName.resize(c.files.size());
   c.nchr = 0;
+  faidx_t* fai = fai_load(c.genome.string().c_str());
+  if (fai == NULL) {
+    std::cerr << "Fail to open genome fai index for " << c.genome.string() << std::endl;
+    return 1;
+  }
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
     if (!(boost::filesystem::exists(c.files[file_c]) && boost::filesystem::is_regular_file(c.files[file_c]) && boost::filesystem::file_size(c.files[file_c]))) {
       std::cerr << "Alignment file is missing: " << c.files[file_c].string() << std::endl;
+      fai_destroy(fai);
       return 1;
     }
     samFile* samfile = sam_open(c.files[file_c].string().c_str(), "r");
     if (samfile == NULL) {
       std::cerr << "Fail to open file " << c.files[file_c].string() << std::endl;
+      fai_destroy(fai);
       return 1;
     }
     hts_idx_t* idx = sam_index_load(samfile, c.files[file_c].string().c_str());
     if (idx == NULL) {
       std::cerr << "Fail to open index for " << c.files[file_c].string() << std::endl;
+      fai_destroy(fai);
       return 1;
     }
     bam_hdr_t* hdr = sam_hdr_read(samfile);
     if (hdr == NULL) {
       std::cerr << "Fail to open header for " << c.files[file_c].string() << std::endl;
+      fai_destroy(fai);
       return 1;
     }
     if (!c.nchr) c.nchr = hdr->n_targets;
     else {
       if (c.nchr != hdr->n_targets) {
 	std::cerr << "BAM files have different number of chromosomes!" << std::endl;
+	fai_destroy(fai);
 	return 1;
       }
     }
-    faidx_t* fai = fai_load(c.genome.string().c_str());
     for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) {
       std::string tname(hdr->target_name[refIndex]);
       if (!faidx_has_seq(fai, tname.c_str())) {
 	std::cerr << "BAM file chromosome " << hdr->target_name[refIndex] << " is NOT present in your reference file " << c.genome.string() << std::endl;
+	fai_destroy(fai);
 	return 1;
       }
     }
-    fai_destroy(fai);
     std::string sampleName = "unknown";
     getSMTag(std::string(hdr->text), c.files[file_c].stem().string(), sampleName);
     c.sampleName[file_c] = sampleName;
@@ -577,6 +624,7 @@ int delly(int argc, char **argv) {
     hts_idx_destroy(idx);
     sam_close(samfile);
   }
+  fai_destroy(fai);
 
   // Check exclude file
   if (vm.count("exclude")) {
@@ -648,7 +696,17 @@ int delly(int argc, char **argv) {
   c.flankQuality = 0.95;
   c.minimumFlankSize = 13;
   c.indelsize = 500;
-  return dellyRun(c);
+
+  // Shared (de)compression threads
+  htsThreadPool tp;
+  if (!_initThreadPool(tp, c.threads)) {
+    std::cerr << "Fail to create thread pool with " << c.threads << " threads!" << std::endl;
+    return 1;
+  }
+  c.tpool = &tp;
+  int rVal = dellyRun(c);
+  _destroyThreadPool(tp);
+  return rVal;
 }
 
 }
@@ -0,0 +1,225 @@
+/*
+============================================================================
+DELLY: Structural variant discovery by integrated PE mapping and SR analysis
+============================================================================
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+#include <stdio.h>
+
+namespace torali
+{
+
+  #define DELLY_RUN_BLOCK 4096
+
+  // Run of records, held in memory or spilled to the run file
+  template<typename TRecord>
+  struct SortedRun {
+    uint32_t order;
+    bool sorted;
+    bool spilled;
+    off_t offset;
+    uint64_t remaining;
+    uint32_t head;
+    std::vector<TRecord> buf;
+
+    SortedRun(uint32_t const o, bool const s) : order(o), sorted(s), spilled(false), offset(0), remaining(0), head(0) {}
+  };
+
+  template<typename TRun>
+  struct SortRunsByOrder : public std::binary_function<TRun, TRun, bool>
+  {
+    inline bool operator()(TRun const& r1, TRun const& r2) const {
+      return (r1.order < r2.order);
+    }
+  };
+
+  // Runs of fixed-size records per SV type, runs beyond the memory budget go to one temporary file
+  template<typename TRecord>
+  struct ExternalRuns {
+    uint64_t budget;
+    uint64_t inMemory;
+    bool failed;
+    boost::filesystem::path path;
+    FILE* fp;
+    std::vector<std::vector<SortedRun<TRecord> > > runs;
+
+    ExternalRuns(uint32_t const nsvt, uint64_t const b) : budget(b), inMemory(0), failed(false), fp(NULL), runs(nsvt) {}
+  };
+
+
+  template<typename TRecord>
+  inline bool
+  _openRunFile(ExternalRuns<TRecord>& er) {
+    boost::system::error_code ec;
+    boost::filesystem::path tmpdir = boost::filesystem::temp_directory_path(ec);
+    if (ec) tmpdir = boost::filesystem::path(".");
+    er.path = tmpdir / boost::filesystem::unique_path("delly-%%%%-%%%%-%%%%-%%%%.run");
+    er.fp = fopen(er.path.string().c_str(), "w+b");
+    if (er.fp == NULL) {
+      std::cerr << "Warning: Cannot create run file " << er.path.string() << ", keeping records in memory" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Add a run, callers serialize access, spilled runs are sorted first
+  template<typename TRecord, typename TCompare>
+  inline bool
+  _addRun(ExternalRuns<TRecord>& er, uint32_t const svt, uint32_t const order, std::vector<TRecord>& recs, bool const sorted, TCompare const& comp) {
+    if (recs.empty()) return true;
+    SortedRun<TRecord> run(order, sorted);
+    uint64_t bytes = recs.size() * sizeof(TRecord);
+    if ((er.budget) && (er.inMemory + bytes > er.budget) && ((er.fp != NULL) || (_openRunFile(er)))) {
+      if (!sorted) std::stable_sort(recs.begin(), recs.end(), comp);
+      // First block stays in memory, the remainder is read back block-wise
+      uint32_t keep = std::min(recs.size(), (std::size_t) DELLY_RUN_BLOCK);
+      fseeko(er.fp, 0, SEEK_END);
+      run.sorted = true;
+      run.spilled = true;
+      run.offset = ftello(er.fp);
+      run.remaining = recs.size() - keep;
+      if ((run.offset < 0) || ((run.remaining) && (fwrite(&recs[keep], sizeof(TRecord), run.remaining, er.fp) != run.remaining))) {
+	std::cerr << "Error: Cannot write run file " << er.path.string() << std::endl;
+	er.failed = true;
+	return false;
+      }
+      run.buf.assign(recs.begin(), recs.begin() + keep);
+      er.inMemory += keep * sizeof(TRecord);
+      std::vector<TRecord>().swap(recs);
+    } else {
+      run.buf.swap(recs);
+      er.inMemory += bytes;
+    }
+    er.runs[svt].push_back(run);
+    return true;
+  }
+
+  // Order runs deterministically, sort in-memory runs if they have to be merged with spilled ones
+  template<typename TRecord, typename TCompare>
+  inline bool
+  _finishRuns(ExternalRuns<TRecord>& er, TCompare const& comp) {
+    if ((er.fp != NULL) && (fflush(er.fp) != 0)) {
+      std::cerr << "Error: Cannot write run file " << er.path.string() << std::endl;
+      er.failed = true;
+    }
+    if (er.failed) return false;
+    for(uint32_t svt = 0; svt < er.runs.size(); ++svt) {
+      std::sort(er.runs[svt].begin(), er.runs[svt].end(), SortRunsByOrder<SortedRun<TRecord> >());
+      if (er.fp == NULL) continue;
+      for(uint32_t r = 0; r < er.runs[svt].size(); ++r) {
+	if (!er.runs[svt][r].sorted) {
+	  std::stable_sort(er.runs[svt][r].buf.begin(), er.runs[svt][r].buf.end(), comp);
+	  er.runs[svt][r].sorted = true;
+	}
+      }
+    }
+    return true;
+  }
+
+  template<typename TRecord>
+  inline bool
+  _refillRun(ExternalRuns<TRecord>& er, SortedRun<TRecord>& run) {
+    run.head = 0;
+    if ((!run.spilled) || (!run.remaining)) {
+      std::vector<TRecord>().swap(run.buf);
+      return false;
+    }
+    uint64_t n = std::min(run.remaining, (uint64_t) DELLY_RUN_BLOCK);
+    run.buf.resize(n, run.buf[0]);
+    std::size_t got = 0;
+#pragma omp critical (runfile)
+    {
+      if (fseeko(er.fp, run.offset, SEEK_SET) == 0) got = fread(&run.buf[0], sizeof(TRecord), n, er.fp);
+      if (got != n) er.failed = true;
+    }
+    if (got != n) {
+      std::cerr << "Error: Truncated run file " << er.path.string() << std::endl;
+      run.remaining = 0;
+      std::vector<TRecord>().swap(run.buf);
+      return false;
+    }
+    run.offset += n * sizeof(TRecord);
+    run.remaining -= n;
+    return true;
+  }
+
+  // Heap order on the current head of each run, ties resolved by run order
+  template<typename TRecord, typename TCompare>
+  struct RunHeadGreater {
+    std::vector<SortedRun<TRecord> > const& runs;
+    TCompare comp;
+
+    RunHeadGreater(std::vector<SortedRun<TRecord> > const& r, TCompare const& c) : runs(r), comp(c) {}
+
+    inline bool operator()(uint32_t const r1, uint32_t const r2) {
+      TRecord const& h1 = runs[r1].buf[runs[r1].head];
+      TRecord const& h2 = runs[r2].buf[runs[r2].head];
+      if (comp(h2, h1)) return true;
+      if (comp(h1, h2)) return false;
+      return (r1 > r2);
+    }
+  };
+
+  template<typename TRecord, typename TCompare>
+  inline void
+  _initMerge(ExternalRuns<TRecord>& er, uint32_t const svt, std::vector<uint32_t>& heap, TCompare const& comp) {
+    heap.clear();
+    std::vector<SortedRun<TRecord> >& runs = er.runs[svt];
+    for(uint32_t r = 0; r < runs.size(); ++r) {
+      if (!runs[r].buf.empty()) heap.push_back(r);
+    }
+    std::make_heap(heap.begin(), heap.end(), RunHeadGreater<TRecord, TCompare>(runs, comp));
+  }
+
+  // Append the next record of the k-way merge, consumed blocks are released
+  template<typename TRecord, typename TCompare>
+  inline bool
+  _nextMerged(ExternalRuns<TRecord>& er, uint32_t const svt, std::vector<uint32_t>& heap, TCompare const& comp, std::vector<TRecord>& out) {
+    if (heap.empty()) return false;
+    std::vector<SortedRun<TRecord> >& runs = er.runs[svt];
+    RunHeadGreater<TRecord, TCompare> greater(runs, comp);
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    SortedRun<TRecord>& run = runs[heap.back()];
+    out.push_back(run.buf[run.head]);
+    if ((++run.head < run.buf.size()) || (_refillRun(er, run))) std::push_heap(heap.begin(), heap.end(), greater);
+    else heap.pop_back();
+    return true;
+  }
+
+  template<typename TRecord>
+  inline void
+  _closeRuns(ExternalRuns<TRecord>& er) {
+    if (er.fp != NULL) {
+      fclose(er.fp);
+      er.fp = NULL;
+      boost::system::error_code ec;
+      boost::filesystem::remove(er.path, ec);
+    }
+    er.runs.clear();
+    er.inMemory = 0;
+  }
+
+}
+
+#endif
@@ -70,6 +70,7 @@ struct FilterConfig {
   int32_t minsize;
   int32_t maxsize;
   int32_t coverage;
+  uint16_t threads;
   float ratiogeno;
   float altaf;
   float controlcont;
@@ -82,6 +83,7 @@ struct FilterConfig {
   boost::filesystem::path outfile;
   boost::filesystem::path samplefile;
   boost::filesystem::path vcffile;
+  htsThreadPool* tpool;
 };
 
 
@@ -91,10 +93,12 @@ filterRun(TFilterConfig const& c) {
 
   // Load bcf file
   htsFile* ifile = hts_open(c.vcffile.string().c_str(), "r");
+  _attachThreadPool(ifile, c.tpool);
   bcf_hdr_t* hdr = bcf_hdr_read(ifile);
 
   // Open output VCF file
   htsFile *ofile = hts_open(c.outfile.string().c_str(), "wb");
+  _attachThreadPool(ofile, c.tpool);
   bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr);
   if (c.filter == "somatic") {
     bcf_hdr_remove(hdr_out, BCF_HL_INFO, "RDRATIO");
@@ -324,6 +328,7 @@ int filter(int argc, char **argv) {
     ("maxsize,n", boost::program_options::value<int32_t>(&c.maxsize)->default_value(500000000), "max. SV size")
     ("ratiogeno,r", boost::program_options::value<float>(&c.ratiogeno)->default_value(0.75), "min. fraction of genotyped samples")
     ("pass,p", "Filter sites for PASS")
+    ("threads", boost::program_options::value<uint16_t>(&c.threads)->default_value(1), "BGZF (de)compression threads")
     ;
 
   // Define somatic options
@@ -479,7 +484,16 @@ int filter(int argc, char **argv) {
   for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
   std::cout << std::endl;
 
-  return filterRun(c);
+  // Shared (de)compression threads
+  htsThreadPool tp;
+  if (!_initThreadPool(tp, c.threads)) {
+    std::cerr << "Fail to create thread pool with " << c.threads << " threads!" << std::endl;
+    return 1;
+  }
+  c.tpool = &tp;
+  int rVal = filterRun(c);
+  _destroyThreadPool(tp);
+  return rVal;
 }
 
 }
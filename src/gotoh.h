@@ -54,7 +54,9 @@ namespace torali
     }
 
     // DP
+    std::vector<TScoreValue> sub;
     for(std::size_t row = 0; row <= m; ++row) {
+      if (row) _scoreRow(a1, a2, p1, p2, row-1, sc, sub);
       for(std::size_t col = 0; col <= n; ++col) {
 	// Initialization
 	if ((row == 0) && (col == 0)) {
@@ -79,7 +81,7 @@ namespace torali
 	  prevsub = s[col];
 	  newhoz = std::max(s[col-1] + _horizontalGap(ac, row, m, sc.go + sc.ge), prevhoz + _horizontalGap(ac, row, m, sc.ge));
 	  v[col] = std::max(prevsub + _verticalGap(ac, col, n, sc.go + sc.ge), prevver + _verticalGap(ac, col, n, sc.ge));
-	  s[col] = std::max(std::max(prevprevsub + _score(a1, a2, p1, p2, row-1, col-1, sc), newhoz), v[col]);
+	  s[col] = std::max(std::max(prevprevsub + sub[col-1], newhoz), v[col]);
 	}
       }
     }
@@ -121,7 +123,9 @@ namespace torali
     }
 
     // DP
+    std::vector<TScoreValue> sub;
     for(std::size_t row = 0; row <= m; ++row) {
+      if (row) _scoreRow(a1, a2, p1, p2, row-1, sc, sub);
       for(std::size_t col = 0; col <= n; ++col) {
 	// Initialization
 	if ((row == 0) && (col == 0)) {
@@ -150,7 +154,7 @@ namespace torali
 	  prevsub = s[col];
 	  newhoz = std::max(s[col-1] + _horizontalGap(ac, row, m, sc.go + sc.ge), prevhoz + _horizontalGap(ac, row, m, sc.ge));
 	  v[col] = std::max(prevsub + _verticalGap(ac, col, n, sc.go + sc.ge), prevver + _verticalGap(ac, col, n, sc.ge));
-	  s[col] = std::max(std::max(prevprevsub + _score(a1, a2, p1, p2, row-1, col-1, sc), newhoz), v[col]);
+	  s[col] = std::max(std::max(prevprevsub + sub[col-1], newhoz), v[col]);
 
 	  // Trace
 	  if (s[col] == newhoz) bit3[row * mf + col] = true;
@@ -35,6 +35,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <htslib/sam.h>
 
 #include "util.h"
+#include "readcache.h"
 
 namespace torali
 {
@@ -59,6 +60,14 @@ namespace torali
       return ((sv1.chr<sv2.chr) || ((sv1.chr==sv2.chr) && (sv1.pos<sv2.pos)) || ((sv1.chr==sv2.chr) && (sv1.pos==sv2.pos) && (sv1.chr2<sv2.chr2)) || ((sv1.chr==sv2.chr) && (sv1.pos==sv2.pos) && (sv1.chr2==sv2.chr2) && (sv1.pos2 < sv2.pos2)));
     }
   };
+
+  template<typename TSRBamRecord>
+  struct SortSRBamRecordId : public std::binary_function<TSRBamRecord, TSRBamRecord, bool>
+  {
+    inline bool operator()(TSRBamRecord const& sv1, TSRBamRecord const& sv2) const {
+      return (sv1.id < sv2.id);
+    }
+  };
   
   
   struct Junction {
@@ -94,6 +103,88 @@ namespace torali
     }
   }
 
+  // Span of all known alignments of a read group (own, mate and SA tag alignments)
+  template<typename TChrMap>
+  inline void
+  _junctionSpan(bam1_t* rec, TChrMap const& chrMap, int32_t& ltid, int32_t& lpos, int32_t& htid, int32_t& hpos) {
+    ltid = rec->core.tid;
+    lpos = rec->core.pos;
+    htid = rec->core.tid;
+    hpos = rec->core.pos;
+    if ((rec->core.flag & BAM_FPAIRED) && (!(rec->core.flag & BAM_FMUNMAP)) && (rec->core.mtid >= 0)) {
+      if ((rec->core.mtid < ltid) || ((rec->core.mtid == ltid) && (rec->core.mpos < lpos))) {
+	ltid = rec->core.mtid;
+	lpos = rec->core.mpos;
+      }
+      if ((rec->core.mtid > htid) || ((rec->core.mtid == htid) && (rec->core.mpos > hpos))) {
+	htid = rec->core.mtid;
+	hpos = rec->core.mpos;
+      }
+    }
+    uint8_t* saptr = bam_aux_get(rec, "SA");
+    if (saptr == NULL) return;
+    char const* sa = bam_aux2Z(saptr);
+    if (sa == NULL) return;
+    // chr,pos,strand,CIGAR,mapq,NM;
+    while (*sa) {
+      char const* sep = strchr(sa, ',');
+      if (sep == NULL) break;
+      typename TChrMap::const_iterator itChr = chrMap.find(std::string(sa, sep));
+      int32_t satid = (itChr != chrMap.end()) ? itChr->second : -1;
+      int32_t sapos = atoi(sep + 1) - 1;
+      if (satid >= 0) {
+	if ((satid < ltid) || ((satid == ltid) && (sapos < lpos))) {
+	  ltid = satid;
+	  lpos = sapos;
+	}
+	if ((satid > htid) || ((satid == htid) && (sapos > hpos))) {
+	  htid = satid;
+	  hpos = sapos;
+	}
+      }
+      sa = strchr(sep, ';');
+      if (sa == NULL) break;
+      ++sa;
+    }
+  }
+
+  // Stage the junctions of an unresolved read group
+  template<typename TJunctionVector>
+  inline void
+  _cacheJunctions(ReadCacheBuffer& buf, unsigned const seed, TJunctionVector const& jv) {
+    uint32_t n = jv.size();
+    _appendRaw(buf.data, seed);
+    _appendRaw(buf.data, n);
+    for(uint32_t i = 0; i < n; ++i) {
+      uint8_t orient = (jv[i].forward ? 1 : 0) | (jv[i].scleft ? 2 : 0);
+      _appendRaw(buf.data, orient);
+      _appendRaw(buf.data, jv[i].refidx);
+      _appendRaw(buf.data, jv[i].rstart);
+      _appendRaw(buf.data, jv[i].refpos);
+      _appendRaw(buf.data, jv[i].seqpos);
+    }
+    ++buf.count;
+  }
+
+  template<typename TJunctionVector>
+  inline bool
+  _nextCachedJunctions(FILE* f, unsigned& seed, TJunctionVector& jv) {
+    typedef typename TJunctionVector::value_type TJunction;
+    uint32_t n = 0;
+    if (fread(&seed, sizeof(unsigned), 1, f) != 1) return false;
+    if (fread(&n, sizeof(uint32_t), 1, f) != 1) return false;
+    jv.clear();
+    jv.reserve(n);
+    for(uint32_t i = 0; i < n; ++i) {
+      uint8_t orient = 0;
+      int32_t val[4];
+      if (fread(&orient, sizeof(uint8_t), 1, f) != 1) return false;
+      if (fread(val, sizeof(int32_t), 4, f) != 4) return false;
+      jv.push_back(TJunction(orient & 1, orient & 2, val[0], val[1], val[2], val[3]));
+    }
+    return true;
+  }
+
   template<typename TJunction>
   struct SortJunction : public std::binary_function<TJunction, TJunction, bool>
   {
@@ -282,6 +373,21 @@ namespace torali
   }
 
 
+  // Sort the junctions of each read group and collect split-read records of all selected SV types
+  template<typename TConfig, typename TReadBp, typename TSRRecords>
+  inline void
+  selectSplitReads(TConfig const& c, TReadBp& readBp, TSRRecords& br) {
+    typedef typename TReadBp::mapped_type TJunctionVector;
+    typedef typename TJunctionVector::value_type TJunction;
+    for(typename TReadBp::iterator it = readBp.begin(); it != readBp.end(); ++it) std::sort(it->second.begin(), it->second.end(), SortJunction<TJunction>());
+    if ((!c.svtcmd) || (c.svtset.find(2) != c.svtset.end())) selectDeletions(c, readBp, br);
+    if ((!c.svtcmd) || (c.svtset.find(3) != c.svtset.end())) selectDuplications(c, readBp, br);
+    if ((!c.svtcmd) || (c.svtset.find(0) != c.svtset.end()) || (c.svtset.find(1) != c.svtset.end())) selectInversions(c, readBp, br);
+    if ((!c.svtcmd) || (c.svtset.find(4) != c.svtset.end())) selectInsertions(c, readBp, br);
+    if ((!c.svtcmd) || (c.svtset.find(DELLY_SVT_TRANS) != c.svtset.end()) || (c.svtset.find(DELLY_SVT_TRANS + 1) != c.svtset.end()) || (c.svtset.find(DELLY_SVT_TRANS + 2) != c.svtset.end()) || (c.svtset.find(DELLY_SVT_TRANS + 3) != c.svtset.end())) selectTranslocations(c, readBp, br);
+  }
+
+
   template<typename TConfig, typename TSRBamRecords>
   inline void
   outputSRBamRecords(TConfig const& c, TSRBamRecords const& br) {
@@ -0,0 +1,149 @@
+/*
+============================================================================
+DELLY: Structural variant discovery by integrated PE mapping and SR analysis
+============================================================================
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef MATETABLE_H
+#define MATETABLE_H
+
+#include <vector>
+
+namespace torali
+{
+
+  #define DELLY_MATETABLE_INIT 1024
+
+  // Slot of the mate table, the mate position decides when a first mate can be evicted
+  template<typename TValue>
+  struct MateSlot {
+    std::size_t hv;
+    int32_t mtid;
+    int32_t mpos;
+    bool used;
+    TValue value;
+
+    MateSlot() : hv(0), mtid(0), mpos(0), used(false), value() {}
+  };
+
+  // Flat, linear-probing table of first mates keyed by hash_pair
+  template<typename TValue>
+  struct MateTable {
+    typedef TValue value_type;
+    typedef MateSlot<TValue> TSlot;
+
+    std::size_t count;
+    std::vector<TSlot> slots;
+
+    MateTable() : count(0), slots(DELLY_MATETABLE_INIT) {}
+  };
+
+
+  inline std::size_t
+  _mateHome(std::size_t const hv, std::size_t const mask) {
+    std::size_t h = hv;
+    h ^= (h >> 17);
+    h *= 0xed5ad4bbU;
+    h ^= (h >> 11);
+    return (h & mask);
+  }
+
+  // Mate lies before the scan position and will never be seen
+  inline bool
+  _mateBehind(int32_t const mtid, int32_t const mpos, int32_t const tid, int32_t const pos) {
+    return ((mtid < tid) || ((mtid == tid) && (mpos < pos)));
+  }
+
+  template<typename TValue>
+  inline void
+  _mateRehash(MateTable<TValue>& mt, std::size_t const cap, int32_t const tid, int32_t const pos) {
+    typedef typename MateTable<TValue>::TSlot TSlot;
+    std::vector<TSlot> old(cap);
+    old.swap(mt.slots);
+    mt.count = 0;
+    std::size_t mask = cap - 1;
+    for(std::size_t i = 0; i < old.size(); ++i) {
+      if ((!old[i].used) || (_mateBehind(old[i].mtid, old[i].mpos, tid, pos))) continue;
+      std::size_t k = _mateHome(old[i].hv, mask);
+      while (mt.slots[k].used) k = (k + 1) & mask;
+      mt.slots[k] = old[i];
+      ++mt.count;
+    }
+  }
+
+  // Insert or overwrite a first mate, a full table first drops mates behind (tid, pos) and only then grows
+  template<typename TValue>
+  inline void
+  _mateInsert(MateTable<TValue>& mt, std::size_t const hv, int32_t const mtid, int32_t const mpos, TValue const& value, int32_t const tid, int32_t const pos) {
+    if ((mt.count + 1) * 10 > mt.slots.size() * 7) {
+      _mateRehash(mt, mt.slots.size(), tid, pos);
+      if ((mt.count + 1) * 10 > mt.slots.size() * 4) _mateRehash(mt, 2 * mt.slots.size(), tid, pos);
+    }
+    std::size_t mask = mt.slots.size() - 1;
+    std::size_t k = _mateHome(hv, mask);
+    while ((mt.slots[k].used) && (mt.slots[k].hv != hv)) k = (k + 1) & mask;
+    if (!mt.slots[k].used) {
+      mt.slots[k].used = true;
+      mt.slots[k].hv = hv;
+      ++mt.count;
+    }
+    mt.slots[k].mtid = mtid;
+    mt.slots[k].mpos = mpos;
+    mt.slots[k].value = value;
+  }
+
+  template<typename TValue>
+  inline TValue*
+  _mateFind(MateTable<TValue>& mt, std::size_t const hv) {
+    std::size_t mask = mt.slots.size() - 1;
+    for(std::size_t k = _mateHome(hv, mask); mt.slots[k].used; k = (k + 1) & mask) {
+      if (mt.slots[k].hv == hv) return &mt.slots[k].value;
+    }
+    return NULL;
+  }
+
+  // Remove a matched mate by backward-shifting its probe sequence, no tombstones
+  template<typename TValue>
+  inline void
+  _mateErase(MateTable<TValue>& mt, std::size_t const hv) {
+    typedef typename MateTable<TValue>::TSlot TSlot;
+    std::size_t mask = mt.slots.size() - 1;
+    std::size_t i = _mateHome(hv, mask);
+    while ((mt.slots[i].used) && (mt.slots[i].hv != hv)) i = (i + 1) & mask;
+    if (!mt.slots[i].used) return;
+    for(std::size_t j = (i + 1) & mask; mt.slots[j].used; j = (j + 1) & mask) {
+      std::size_t k = _mateHome(mt.slots[j].hv, mask);
+      if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+      mt.slots[i] = mt.slots[j];
+      i = j;
+    }
+    mt.slots[i] = TSlot();
+    --mt.count;
+  }
+
+  template<typename TValue>
+  inline void
+  _mateClear(MateTable<TValue>& mt) {
+    typedef typename MateTable<TValue>::TSlot TSlot;
+    std::vector<TSlot>(DELLY_MATETABLE_INIT).swap(mt.slots);
+    mt.count = 0;
+  }
+
+}
+
+#endif
@@ -63,9 +63,11 @@ struct MergeConfig {
   uint32_t bpoffset;
   uint32_t minsize;
   uint32_t maxsize;
+  uint16_t threads;
   float recoverlap;
   boost::filesystem::path outfile;
   std::vector<boost::filesystem::path> files;
+  htsThreadPool* tpool;
 };
 
 struct IntervalScore {
@@ -112,6 +114,7 @@ void _fillIntervalMap(MergeConfig const& c, TGenomeIntervals& iScore, TContigMap
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
     ++show_progress;
     htsFile* ifile = bcf_open(c.files[file_c].string().c_str(), "r");
+    _attachThreadPool(ifile, c.tpool);
     bcf_hdr_t* hdr = bcf_hdr_read(ifile);
     bcf1_t* rec = bcf_init();
 
@@ -264,6 +267,7 @@ void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected,
 
   // Open output VCF file
   htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+  _attachThreadPool(fp, c.tpool);
   bcf_hdr_t *hdr_out = bcf_hdr_init("w");
 
   // Write VCF header
@@ -326,6 +330,7 @@ void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected,
   uint32_t allEOF = 0;
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
     ifile[file_c] = bcf_open(c.files[file_c].string().c_str(), "r");
+    _attachThreadPool(ifile[file_c], c.tpool);
     hdr[file_c] = bcf_hdr_read(ifile[file_c]);
     bcf_hdr_set_samples(hdr[file_c], NULL, false); // Do not read the sample information
     rec[file_c] = bcf_init();
@@ -575,6 +580,7 @@ mergeBCFs(MergeConfig& c, std::vector<boost::filesystem::path> const& cts) {
   uint32_t allEOF = 0;
   for(unsigned int file_c = 0; file_c < cts.size(); ++file_c) {
     ifile[file_c] = bcf_open(cts[file_c].string().c_str(), "r");
+    _attachThreadPool(ifile[file_c], c.tpool);
     hdr[file_c] = bcf_hdr_read(ifile[file_c]);
     rec[file_c] = bcf_init();
     if (bcf_read(ifile[file_c], hdr[file_c], rec[file_c]) == 0) {
@@ -588,6 +594,7 @@ mergeBCFs(MergeConfig& c, std::vector<boost::filesystem::path> const& cts) {
 
   // Open output VCF file
   htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+  _attachThreadPool(fp, c.tpool);
   bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr[0]);
   bcf_hdr_write(fp, hdr_out);
 
@@ -641,6 +648,7 @@ mergeRun(MergeConfig& c, int32_t const svt) {
   uint32_t numseq = 0;
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
     htsFile* ifile = bcf_open(c.files[file_c].string().c_str(), "r");
+    _attachThreadPool(ifile, c.tpool);
     bcf_hdr_t* hdr = bcf_hdr_read(ifile);
     const char** seqnames = NULL;
     int nseq=0;
@@ -692,6 +700,7 @@ int merge(int argc, char **argv) {
     ("maxsize,n", boost::program_options::value<uint32_t>(&c.maxsize)->default_value(1000000), "max. SV size")
     ("precise,c", "Filter sites for PRECISE")
     ("pass,p", "Filter sites for PASS")
+    ("threads", boost::program_options::value<uint16_t>(&c.threads)->default_value(1), "BGZF (de)compression threads")
     ;
 
   // Define overlap options
@@ -752,6 +761,14 @@ int merge(int argc, char **argv) {
     bcf_close(ifile);
   }
   
+  // Shared (de)compression threads
+  htsThreadPool tp;
+  if (!_initThreadPool(tp, c.threads)) {
+    std::cerr << "Fail to create thread pool with " << c.threads << " threads!" << std::endl;
+    return 1;
+  }
+  c.tpool = &tp;
+
   // Run merging
   boost::filesystem::path oldPath = c.outfile;
   int rVal = 0;
@@ -769,6 +786,7 @@ int merge(int argc, char **argv) {
     boost::filesystem::remove(svtCollect[svt]);
     boost::filesystem::remove(boost::filesystem::path(svtCollect[svt].string() + ".csi"));
   }
+  _destroyThreadPool(tp);
   return rVal;
 }
 
@@ -25,7 +25,9 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <htslib/sam.h>
 #include <htslib/vcf.h>
 
+#include "util.h"
 #include "bolog.h"
+#include "refcache.h"
 
 
 
@@ -170,15 +172,16 @@ struct cstyle_str {
 // Parse Delly vcf file
 template<typename TConfig, typename TStructuralVariantRecord>
 inline void
-vcfParse(TConfig const& c, bam_hdr_t* hd, std::vector<TStructuralVariantRecord>& svs) {
+vcfParse(TConfig const& c, bam_hdr_t* hd, ReferenceCache& ref, std::vector<TStructuralVariantRecord>& svs) {
   // Load bcf file
   htsFile* ifile = bcf_open(c.vcffile.string().c_str(), "r");
+  _attachThreadPool(ifile, c.tpool);
   bcf_hdr_t* hdr = bcf_hdr_read(ifile);
   bcf1_t* rec = bcf_init();
 
   // Parse genome if necessary
-  faidx_t* fai = fai_load(c.genome.string().c_str());
-  char* seq = NULL;
+  ReferenceCache::TContig contig;
+  char const* seq = NULL;
   int32_t lastRefIndex = -1;
   
   // Parse bcf
@@ -337,9 +340,9 @@ vcfParse(TConfig const& c, bam_hdr_t* hd, std::vector<TStructuralVariantRecord>&
 
 	// Lazy loading of reference sequence
 	if ((seq == NULL) || (tid != lastRefIndex)) {
-	  if (seq != NULL) free(seq);
 	  int32_t seqlen = -1;
-	  seq = faidx_fetch_seq(fai, chrName.c_str(), 0, faidx_seq_len(fai, chrName.c_str()), &seqlen);
+	  contig = _fetchContig(ref, chrName, seqlen);
+	  seq = contig.get();
 	  lastRefIndex = tid;
 	}
 
@@ -381,9 +384,8 @@ vcfParse(TConfig const& c, bam_hdr_t* hd, std::vector<TStructuralVariantRecord>&
   free(ct);
   free(chr2);
 
-  // Clean-up index
-  if (seq != NULL) free(seq);
-  fai_destroy(fai);
+  // Release reference
+  contig.reset();
   
   // Close VCF
   bcf_hdr_destroy(hdr);
@@ -406,6 +408,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
 
   // Output all structural variants
   htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+  _attachThreadPool(fp, c.tpool);
   bcf_hdr_t *hdr = bcf_hdr_init("w");
 
   // Print vcf header
@@ -23,111 +23,237 @@ Contact: Tobias Rausch (rausch@embl.de)
 #define MSA_H
 
 #include <boost/multi_array.hpp>
+#include <boost/unordered_map.hpp>
+#include <limits>
+#include <map>
 #include "needle.h"
 #include "gotoh.h"
 
 namespace torali {
 
+  #define DELLY_ANCHOR_KMER 11
+  #define DELLY_ANCHOR_SEEDS 3
+  #define DELLY_ANCHOR_MISMATCH 5
+
+  // Match bit-vectors of a sequence, 64 positions per word
+  struct LcsProfile {
+    uint32_t words;
+    uint8_t alpha[256];
+    std::vector<uint64_t> peq;
+
+    LcsProfile() : words(0) {}
+  };
+
+  inline void
+  _lcsProfile(std::string const& s, LcsProfile& prof) {
+    prof.words = (s.size() + 63) / 64;
+    std::fill(prof.alpha, prof.alpha + 256, 0);
+    prof.peq.clear();
+    uint8_t nchar = 0;
+    for(uint32_t i = 0; i < s.size(); ++i) {
+      uint8_t ch = (uint8_t) s[i];
+      if (!prof.alpha[ch]) {
+	prof.alpha[ch] = ++nchar;
+	prof.peq.resize(nchar * prof.words, 0);
+      }
+      prof.peq[(prof.alpha[ch] - 1) * prof.words + i / 64] |= ((uint64_t) 1 << (i % 64));
+    }
+  }
+
+  // Bit-parallel LCS length (Allison-Dix, Hyyro), the profile is the column sequence
   inline int32_t
-  lcs(std::string const& s1, std::string const& s2) {
-    uint32_t m = s1.size();
-    uint32_t n = s2.size();
-    int32_t prevdiag = 0;
-    int32_t prevprevdiag = 0;
-    std::vector<int32_t> onecol(n+1, 0);
-    for(uint32_t i = 0; i <= m; ++i) {
-      for(uint32_t j = 0; j <= n; ++j) {
-	if ((i==0) || (j==0)) {
-	  onecol[j] = 0;
-	  prevprevdiag = 0;
-	  prevdiag = 0;
-	} else {
-	  prevprevdiag = prevdiag;
-	  prevdiag = onecol[j];
-	  if (s1[i-1] == s2[j-1]) onecol[j] = prevprevdiag + 1;
-	  else onecol[j] = (onecol[j] > onecol[j-1]) ? onecol[j] : onecol[j-1];
-	}
+  lcs(LcsProfile const& prof, std::string const& s2, std::vector<uint64_t>& v) {
+    if (!prof.words) return 0;
+    v.assign(prof.words, ~(uint64_t) 0);
+    for(uint32_t j = 0; j < s2.size(); ++j) {
+      uint8_t k = prof.alpha[(uint8_t) s2[j]];
+      if (!k) continue;
+      uint64_t const* pm = &prof.peq[(k - 1) * prof.words];
+      uint64_t carry = 0;
+      for(uint32_t w = 0; w < prof.words; ++w) {
+	uint64_t u = v[w] & pm[w];
+	uint64_t sum = v[w] + u;
+	uint64_t c1 = (sum < v[w]);
+	sum += carry;
+	carry = c1 | (sum < carry);
+	v[w] = sum | (v[w] & ~pm[w]);
       }
     }
-    return onecol[n];
+    // Unused high bits stay set
+    int32_t ones = 0;
+    for(uint32_t w = 0; w < prof.words; ++w) ones += __builtin_popcountll(v[w]);
+    return (int32_t) (prof.words * 64) - ones;
+  }
+
+  inline int32_t
+  lcs(std::string const& s1, std::string const& s2) {
+    LcsProfile prof;
+    _lcsProfile(s1, prof);
+    std::vector<uint64_t> v;
+    return lcs(prof, s2, v);
   }
 
   template<typename TSplitReadSet, typename TDistArray>
   inline void
   distanceMatrix(TSplitReadSet const& sps, TDistArray& d) {
     typedef typename TDistArray::index TDIndex;
-    typename TSplitReadSet::const_iterator sIt1 = sps.begin();
-    for (TDIndex i = 0; sIt1 != sps.end(); ++sIt1, ++i) {
-      typename TSplitReadSet::const_iterator sIt2 = sIt1;
-      ++sIt2;
-      for (TDIndex j = i+1; sIt2 != sps.end(); ++sIt2, ++j) {
-	d[i][j] = (lcs(*sIt1, *sIt2) * 100) / std::min(sIt1->size(), sIt2->size());
-      }
+    std::vector<std::string const*> seqs;
+    for(typename TSplitReadSet::const_iterator sIt = sps.begin(); sIt != sps.end(); ++sIt) seqs.push_back(&(*sIt));
+    int32_t num = seqs.size();
+    std::vector<LcsProfile> prof(num);
+    for(int32_t i = 0; i < num; ++i) _lcsProfile(*seqs[i], prof[i]);
+
+    // All pairs, callers already run one split-read set per thread
+    std::vector<uint64_t> v;
+    for(int32_t i = 0; i < num; ++i) {
+      for(int32_t j = i + 1; j < num; ++j) d[(TDIndex) i][(TDIndex) j] = (lcs(prof[i], *seqs[j], v) * 100) / std::min(seqs[i]->size(), seqs[j]->size());
     }
   }
 
+  // Most similar active partner of slot k among clusters created after it, ties go to the older cluster
   template<typename TDistArray, typename TDIndex>
-  inline int
-  closestPair(TDistArray const& d, TDIndex num, TDIndex& dI, TDIndex& dJ) {
-    int dMax = -1;
-    for (TDIndex i = 0; i<num; ++i) {
-      for (TDIndex j = i+1; j<num; ++j) {
-	if (d[i][j]>dMax) {
-	  dMax = d[i][j];
-	  dI = i;
-	  dJ = j;
-	}
+  inline void
+  _nearestNeighbour(TDistArray const& d, std::vector<TDIndex> const& node, std::vector<bool> const& active, TDIndex k, std::vector<int>& bestVal, std::vector<TDIndex>& bestSlot) {
+    bestVal[k] = -1;
+    bestSlot[k] = k;
+    for (TDIndex s = 0; s < (TDIndex) node.size(); ++s) {
+      if ((!active[s]) || (node[s] <= node[k])) continue;
+      if ((d[k][s] > bestVal[k]) || ((d[k][s] == bestVal[k]) && (node[s] < node[bestSlot[k]]))) {
+	bestVal[k] = d[k][s];
+	bestSlot[k] = s;
       }
     }
-    return dMax;
-  }
-
-  template<typename TDistArray, typename TPhylogeny, typename TDIndex>
-  inline void
-  updateDistanceMatrix(TDistArray& d, TPhylogeny const& p, TDIndex num, TDIndex& dI, TDIndex& dJ) {
-    for (TDIndex i = 0; i < num; ++i) 
-      if (p[i][0] == -1) 
-	d[i][num] = (((dI < i) ? d[dI][i] : d[i][dI]) + ((dJ < i) ? d[dJ][i] : d[i][dJ])) / 2;
-    for (TDIndex i = 0; i<dI; ++i) d[i][dI] = -1;
-    for (TDIndex i = dI+1; i<num+1; ++i) d[dI][i] = -1;
-    for (TDIndex i = 0; i<dJ; ++i) d[i][dJ] = -1;
-    for (TDIndex i = dJ+1; i<num+1; ++i) d[dJ][i] = -1;
   }
 
+  // UPGMA on the upper triangle of a num x num similarity matrix, a merged cluster reuses the slot of its first child
   template<typename TDistArray, typename TPhylogeny, typename TDIndex>
   inline TDIndex
   upgma(TDistArray& d, TPhylogeny& p, TDIndex num) {
+    std::vector<TDIndex> node(num);
+    std::vector<bool> active(num, true);
+    for (TDIndex i = 0; i < num; ++i) {
+      node[i] = i;
+      for (TDIndex j = i+1; j < num; ++j) d[j][i] = d[i][j];
+    }
+    std::vector<int> bestVal(num, -1);
+    std::vector<TDIndex> bestSlot(num, 0);
+    for (TDIndex k = 0; k < num; ++k) _nearestNeighbour(d, node, active, k, bestVal, bestSlot);
+
     TDIndex nn = num;
     for(;nn<2*num+1; ++nn) {
-      TDIndex dI = 0;
-      TDIndex dJ = 0;
-      if (closestPair(d, nn, dI, dJ) == -1) break;
+      // Closest pair, ties resolved in node order
+      TDIndex sI = 0;
+      int dMax = -1;
+      for (TDIndex k = 0; k < num; ++k) {
+	if ((active[k]) && ((bestVal[k] > dMax) || ((bestVal[k] == dMax) && (dMax != -1) && (node[k] < node[sI])))) {
+	  dMax = bestVal[k];
+	  sI = k;
+	}
+      }
+      if (dMax == -1) break;
+      TDIndex sJ = bestSlot[sI];
+      TDIndex dI = node[sI];
+      TDIndex dJ = node[sJ];
       p[dI][0] = nn;
       p[dJ][0] = nn;
       p[nn][1] = dI;
       p[nn][2] = dJ;
-      updateDistanceMatrix(d, p, nn, dI, dJ);
+
+      // Average similarity to the merged cluster
+      active[sJ] = false;
+      node[sI] = nn;
+      for (TDIndex k = 0; k < num; ++k) {
+	if ((active[k]) && (k != sI)) {
+	  d[sI][k] = (d[sI][k] + d[sJ][k]) / 2;
+	  d[k][sI] = d[sI][k];
+	}
+      }
+      bestVal[sI] = -1;
+      for (TDIndex k = 0; k < num; ++k) {
+	if ((!active[k]) || (k == sI)) continue;
+	if ((bestSlot[k] == sI) || (bestSlot[k] == sJ)) _nearestNeighbour(d, node, active, k, bestVal, bestSlot);
+	else if (d[k][sI] > bestVal[k]) {
+	  bestVal[k] = d[k][sI];
+	  bestSlot[k] = sI;
+	}
+      }
     }
     return (nn > 0) ? (nn - 1) : 0;
   }
 
-  template<typename TConfig, typename TSplitReadSet, typename TPhylogeny, typename TDIndex, typename TAlign>
+  // Column-major bit-planes of an alignment, 64 rows per word: A, C, G, T, N and the span of each read
+  struct PackedAlignment {
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t words;
+    std::vector<uint64_t> bits;
+
+    PackedAlignment(uint32_t const r, uint32_t const c) : rows(r), cols(c), words((r + 63) / 64), bits(6 * ((r + 63) / 64) * c, 0) {}
+  };
+
   inline void
-  palign(TConfig const& c, TSplitReadSet const& sps, TPhylogeny const& p, TDIndex root, TAlign& align) {
-    typedef typename TAlign::index TAIndex;
+  _packLetter(PackedAlignment& pa, uint32_t const row, uint32_t const col, char const ch) {
+    int k = _profileIndex(ch);
+    if (k < 5) pa.bits[(6 * col + k) * pa.words + row / 64] |= ((uint64_t) 1 << (row % 64));
+  }
+
+  // Columns [first, last] are covered by the read in row
+  inline void
+  _packSpan(PackedAlignment& pa, uint32_t const row, uint32_t const first, uint32_t const last) {
+    for(uint32_t col = first; col <= last; ++col) pa.bits[(6 * col + 5) * pa.words + row / 64] |= ((uint64_t) 1 << (row % 64));
+  }
+
+  // Letters within the read spans and span coverage of one column
+  inline void
+  _columnCounts(PackedAlignment const& pa, uint32_t const col, uint32_t* cnt) {
+    uint64_t const* plane = &pa.bits[6 * col * pa.words];
+    uint64_t const* span = plane + 5 * pa.words;
+    for(int k = 0; k < 6; ++k) cnt[k] = 0;
+    for(uint32_t w = 0; w < pa.words; ++w) {
+      for(int k = 0; k < 5; ++k) cnt[k] += __builtin_popcountll(plane[k * pa.words + w] & span[w]);
+      cnt[5] += __builtin_popcountll(span[w]);
+    }
+  }
+
+  // Progressive alignment on column counts, child counts are released once merged
+  template<typename TConfig, typename TSplitReadSet, typename TPhylogeny, typename TDIndex>
+  inline void
+  palign(TConfig const& c, TSplitReadSet const& sps, TPhylogeny const& p, TDIndex root, std::vector<AlignProfile>& prof) {
     if ((p[root][1] == -1) && (p[root][2] == -1)) {
       typename TSplitReadSet::const_iterator sIt = sps.begin();
       if (root) std::advance(sIt, root);
-      align.resize(boost::extents[1][sIt->size()]);
-      TAIndex ind = 0;
-      for(typename std::string::const_iterator str = sIt->begin(); str != sIt->end(); ++str) align[0][ind++] = *str;
+      _initProfile(*sIt, prof[root]);
     } else {
-      TAlign align1;
-      palign(c, sps, p, p[root][1], align1);
-      TAlign align2;
-      palign(c, sps, p, p[root][2], align2);
+      TDIndex left = p[root][1];
+      TDIndex right = p[root][2];
+      palign(c, sps, p, left, prof);
+      palign(c, sps, p, right, prof);
       AlignConfig<true, true> endFreeAlign;
-      gotoh(align1, align2, align, endFreeAlign, c.aliscore);
+      gotoh(prof[left], prof[right], prof[root], endFreeAlign, c.aliscore);
+      std::vector<uint32_t>().swap(prof[left].counts);
+      std::vector<uint32_t>().swap(prof[right].counts);
+    }
+  }
+
+  // Letters of all sequences below node, colmap gives the alignment column of each node column
+  template<typename TPhylogeny, typename TDIndex>
+  inline void
+  _layoutAlignment(std::vector<AlignProfile> const& prof, TPhylogeny const& p, TDIndex node, std::vector<uint32_t> const& colmap, TDIndex& arow, PackedAlignment& align) {
+    if ((p[node][1] == -1) && (p[node][2] == -1)) {
+      std::string const& seq = prof[node].seq;
+      for(uint32_t j = 0; j < seq.size(); ++j) _packLetter(align, arow, colmap[j], seq[j]);
+      if (!seq.empty()) _packSpan(align, arow, colmap[0], colmap[seq.size() - 1]);
+      ++arow;
+    } else {
+      std::vector<uint32_t> map1;
+      std::vector<uint32_t> map2;
+      std::vector<char> const& trace = prof[node].trace;
+      for(uint32_t ai = 0; ai < trace.size(); ++ai) {
+	if (trace[ai] != 'h') map1.push_back(colmap[ai]);
+	if (trace[ai] != 'v') map2.push_back(colmap[ai]);
+      }
+      _layoutAlignment(prof, p, (TDIndex) p[node][1], map1, arow, align);
+      _layoutAlignment(prof, p, (TDIndex) p[node][2], map2, arow, align);
     }
   }
 
@@ -179,50 +305,38 @@ namespace torali {
 
   template<typename TAlign>
   inline void
-  consensus(TAlign const& align, std::string& cs) {
+  _packAlignment(TAlign const& align, PackedAlignment& pa) {
     typedef typename TAlign::index TAIndex;
-
-    // Calculate coverage
-    typedef boost::multi_array<bool, 2> TFlag;
-    TFlag fl;
-    fl.resize(boost::extents[align.shape()[0]][align.shape()[1]]);
-    typedef std::vector<int> TCoverage;
-    TCoverage cov;
-    cov.resize(align.shape()[1], 0);
     for(TAIndex i = 0; i < (TAIndex) align.shape()[0]; ++i) {
       int start = 0;
       int end = -1;
       for(TAIndex j = 0; j < (TAIndex) align.shape()[1]; ++j) {
-	fl[i][j] = false;
-	if (align[i][j] != '-') end = j;
+	if (align[i][j] != '-') {
+	  end = j;
+	  _packLetter(pa, i, j, align[i][j]);
+	}
 	else if (end == -1) start = j + 1;
       }
-      for(TAIndex j = start; j<=end; ++j) {
-	++cov[j];
-	fl[i][j] = true;
-      }
+      if (end != -1) _packSpan(pa, i, start, end);
     }
-    
+  }
+
+  inline void
+  consensus(PackedAlignment const& pa, std::string& cs) {
     int covThreshold = 3;
-    TAIndex j = 0;
     std::vector<char> cons;
-    for(typename TCoverage::const_iterator itCov = cov.begin(); itCov != cov.end(); ++itCov, ++j) {
-      if (*itCov >= covThreshold) {
+    uint32_t cnt[6];
+    for(uint32_t j = 0; j < pa.cols; ++j) {
+      _columnCounts(pa, j, cnt);
+      int cov = cnt[5];
+      if (cov >= covThreshold) {
 	// Get consensus letter
-	int countA = 0;
-	int countC = 0;
-	int countG = 0;
-	int countT = 0;
-	for(TAIndex i = 0; i < (TAIndex) align.shape()[0]; ++i) {
-	  if (fl[i][j]) {
-	    if ((align[i][j] == 'A') || (align[i][j] == 'a')) ++countA;
-	    else if ((align[i][j] == 'C') || (align[i][j] == 'c')) ++countC;
-	    else if ((align[i][j] == 'G') || (align[i][j] == 'g')) ++countG;
-	    else if ((align[i][j] == 'T') || (align[i][j] == 't')) ++countT;
-	  }
-	}
+	int countA = cnt[0];
+	int countC = cnt[1];
+	int countG = cnt[2];
+	int countT = cnt[3];
 	int countAligned = countA + countC + countG + countT;
-	if (countAligned > (*itCov / 2)) {
+	if (countAligned > (cov / 2)) {
 	  if (countA > countC) {
 	    if (countA > countG) {
 	      if (countA > countT) cons.push_back('A');
@@ -246,6 +360,129 @@ namespace torali {
     cs = std::string(cons.begin(), cons.end());
   }
 
+  template<typename TAlign>
+  inline void
+  consensus(TAlign const& align, std::string& cs) {
+    PackedAlignment pa(align.shape()[0], align.shape()[1]);
+    _packAlignment(align, pa);
+    consensus(pa, cs);
+  }
+
+
+  // 2-bit code of the k-mer at pos, false if it contains an ambiguous base
+  inline bool
+  _anchorKmer(std::string const& s, uint32_t const pos, uint32_t& code) {
+    code = 0;
+    for(uint32_t i = pos; i < pos + DELLY_ANCHOR_KMER; ++i) {
+      switch (s[i]) {
+      case 'A': case 'a': code = (code << 2); break;
+      case 'C': case 'c': code = (code << 2) | 1; break;
+      case 'G': case 'g': code = (code << 2) | 2; break;
+      case 'T': case 't': code = (code << 2) | 3; break;
+      default: return false;
+      }
+    }
+    return true;
+  }
+
+  template<typename TKmerColumn>
+  inline void
+  _addAnchorKmers(std::string const& s, int32_t const offset, TKmerColumn& index) {
+    for(uint32_t pos = 0; pos + DELLY_ANCHOR_KMER <= s.size(); ++pos) {
+      uint32_t code = 0;
+      if (!_anchorKmer(s, pos, code)) continue;
+      typename TKmerColumn::iterator it = index.find(code);
+      if (it == index.end()) index.insert(std::make_pair(code, offset + (int32_t) pos));
+      else if (it->second != offset + (int32_t) pos) it->second = std::numeric_limits<int32_t>::min();
+    }
+  }
+
+  // Ungapped layout of all reads on shared k-mers, false if a read cannot be placed unambiguously or the reads disagree
+  template<typename TSplitReadSet>
+  inline bool
+  anchoredConsensus(TSplitReadSet const& sps, std::string& cs) {
+    typedef boost::unordered_map<uint32_t, int32_t> TKmerColumn;
+    if (sps.size() < 3) return false;
+    std::vector<std::string const*> seqs;
+    uint32_t seed = 0;
+    for(typename TSplitReadSet::const_iterator sIt = sps.begin(); sIt != sps.end(); ++sIt) {
+      seqs.push_back(&(*sIt));
+      if (seqs.back()->size() > seqs[seed]->size()) seed = seqs.size() - 1;
+    }
+    uint32_t num = seqs.size();
+
+    // Place reads next to already placed ones, the longest read is the seed
+    std::vector<int32_t> offset(num, 0);
+    std::vector<bool> placed(num, false);
+    TKmerColumn index;
+    placed[seed] = true;
+    _addAnchorKmers(*seqs[seed], 0, index);
+    uint32_t nplaced = 1;
+    bool progress = true;
+    while ((nplaced < num) && (progress)) {
+      progress = false;
+      for(uint32_t i = 0; i < num; ++i) {
+	if (placed[i]) continue;
+	std::map<int32_t, uint32_t> votes;
+	for(uint32_t pos = 0; pos + DELLY_ANCHOR_KMER <= seqs[i]->size(); ++pos) {
+	  uint32_t code = 0;
+	  if (!_anchorKmer(*seqs[i], pos, code)) continue;
+	  TKmerColumn::const_iterator it = index.find(code);
+	  if ((it != index.end()) && (it->second != std::numeric_limits<int32_t>::min())) ++votes[it->second - (int32_t) pos];
+	}
+	// Conflicting offsets indicate an indel between reads
+	if (votes.size() > 1) return false;
+	if ((votes.empty()) || (votes.begin()->second < DELLY_ANCHOR_SEEDS)) continue;
+	offset[i] = votes.begin()->first;
+	placed[i] = true;
+	_addAnchorKmers(*seqs[i], offset[i], index);
+	++nplaced;
+	progress = true;
+      }
+    }
+    if (nplaced < num) return false;
+
+    // Packed layout
+    int32_t minOff = offset[0];
+    int32_t maxEnd = offset[0] + seqs[0]->size();
+    for(uint32_t i = 1; i < num; ++i) {
+      minOff = std::min(minOff, offset[i]);
+      maxEnd = std::max(maxEnd, offset[i] + (int32_t) seqs[i]->size());
+    }
+    PackedAlignment pa(num, maxEnd - minOff);
+    for(uint32_t i = 0; i < num; ++i) {
+      if (seqs[i]->empty()) continue;
+      for(uint32_t j = 0; j < seqs[i]->size(); ++j) _packLetter(pa, i, offset[i] - minOff + j, (*seqs[i])[j]);
+      _packSpan(pa, i, offset[i] - minOff, offset[i] - minOff + seqs[i]->size() - 1);
+    }
+
+    // Column majority, clustered disagreements of a read hint at an indel near its end
+    std::vector<char> major(maxEnd - minOff, '-');
+    uint32_t cnt[6];
+    for(int32_t j = 0; j < maxEnd - minOff; ++j) {
+      _columnCounts(pa, j, cnt);
+      if (cnt[0] + cnt[1] + cnt[2] + cnt[3] + cnt[4] < 2) continue;
+      int best = 0;
+      for(int k = 1; k < 4; ++k) if (cnt[k] > cnt[best]) best = k;
+      major[j] = "ACGT"[best];
+    }
+    for(uint32_t i = 0; i < num; ++i) {
+      uint32_t disagree = 0;
+      int32_t lastPos = -DELLY_ANCHOR_KMER;
+      for(uint32_t j = 0; j < seqs[i]->size(); ++j) {
+	int32_t col = offset[i] - minOff + j;
+	if ((major[col] == '-') || (major[col] == std::toupper((*seqs[i])[j]))) continue;
+	if ((int32_t) j - lastPos < DELLY_ANCHOR_KMER) return false;
+	lastPos = j;
+	++disagree;
+      }
+      if (disagree * 100 > seqs[i]->size() * DELLY_ANCHOR_MISMATCH) return false;
+    }
+
+    consensus(pa, cs);
+    return (!cs.empty());
+  }
+
 
   template<typename TConfig, typename TSplitReadSet>
   inline int
@@ -254,10 +491,7 @@ namespace torali {
     typedef boost::multi_array<int, 2> TDistArray;
     typedef typename TDistArray::index TDIndex;
     TDIndex num = sps.size();
-    TDistArray d(boost::extents[2*num+1][2*num+1]);
-    for (TDIndex i = 0; i<(2*num+1); ++i) 
-      for (TDIndex j = i+1; j<(2*num+1); ++j) 
-	d[i][j]=-1;
+    TDistArray d(boost::extents[num][num]);
     distanceMatrix(sps, d);
 
     // UPGMA
@@ -281,29 +515,24 @@ namespace torali {
     //}
     
     // Progressive Alignment
-    typedef boost::multi_array<char, 2> TAlign;
-    TAlign align;
-    palign(c, sps, p, root, align);
-
-    // Debug MSA
-    //typedef typename TAlign::index TAIndex;
-    //for(TAIndex i = 0; i<align.shape()[0]; ++i) {
-    //for(TAIndex j = 0; j<align.shape()[1]; ++j) {
-    //std::cerr << align[i][j];
-    //}
-    //std::cerr << std::endl;
-    //}
+    std::vector<AlignProfile> prof(2*num+1);
+    palign(c, sps, p, root, prof);
 
-    // Sequence to profile re-alignment
-    //sprealign(align);
+    // Packed alignment, materialized once at the root
+    std::size_t cols = _size(prof[root], 1);
+    PackedAlignment pa(prof[root].nseq, cols);
+    std::vector<uint32_t> colmap(cols);
+    for(uint32_t j = 0; j < cols; ++j) colmap[j] = j;
+    TDIndex arow = 0;
+    _layoutAlignment(prof, p, root, colmap, arow, pa);
 
     // Consensus calling
-    consensus(align, cs);
+    consensus(pa, cs);
     //std::cerr << cs << std::endl;
     //std::cerr << std::endl;
     
     // Return split-read support
-    return align.shape()[0];
+    return pa.rows;
   }
 
 }
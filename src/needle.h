@@ -24,43 +24,145 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #define BOOST_DISABLE_ASSERTS
 #include <boost/multi_array.hpp>
+#include <cmath>
+#include <limits>
+#include <vector>
 #include <iostream>
 #include "align.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace torali
 {
 
   inline int32_t
-  longestHomology(std::string const& s1, std::string const& s2, int32_t scoreThreshold)  {
-    // DP Matrix
-    typedef boost::multi_array<int32_t, 2> TMatrix;
+  longestHomology(std::string const& s1, std::string const& s2, int32_t scoreThreshold, AlignWorkspace& ws)  {
+    // DP rows, only the band around the diagonal is used
     int32_t m = s1.size();
     int32_t n = s2.size();
-    TMatrix mat(boost::extents[m+1][n+1]);
+    std::vector<int32_t>& prev = ws.row1;
+    std::vector<int32_t>& cur = ws.row2;
+    prev.assign(n+1, 0);
+    cur.assign(n+1, 0);
 
     // Initialization
     int32_t k = std::abs(scoreThreshold);
-    mat[0][0] = 0;
-    for(int32_t col = 1; col <= k; ++col) mat[0][col] = mat[0][col-1] - 1;
-    for(int32_t row = 1; row <= k; ++row) mat[row][0] = mat[row-1][0] - 1;
+    prev[0] = 0;
+    for(int32_t col = 1; col <= std::min(k, n); ++col) prev[col] = prev[col-1] - 1;
 
     // Edit distance
     for(int32_t row = 1; row <= m; ++row) {
+      cur[0] = (row <= k) ? -row : 0;
       int32_t bestCol = scoreThreshold - 1;
       for(int32_t h = -k; h <= k; ++h) {
 	int32_t col = row + h;
 	if ((col >= 1) && (col <= n)) {
-	  mat[row][col] = mat[row-1][col-1] + (s1[row-1] == s2[col-1] ? 0 : -1);
-	  if ((row - 1 - col >= -k) && (row - 1 - col <= k)) mat[row][col] = std::max(mat[row][col], mat[row-1][col] - 1);
-	  if ((row - col + 1 >= -k) && (row - col + 1 <= k)) mat[row][col] = std::max(mat[row][col], mat[row][col-1] - 1);
-	  if (mat[row][col] > bestCol) bestCol = mat[row][col];
+	  cur[col] = prev[col-1] + (s1[row-1] == s2[col-1] ? 0 : -1);
+	  if ((row - 1 - col >= -k) && (row - 1 - col <= k)) cur[col] = std::max(cur[col], prev[col] - 1);
+	  if ((row - col + 1 >= -k) && (row - col + 1 <= k)) cur[col] = std::max(cur[col], cur[col-1] - 1);
+	  if (cur[col] > bestCol) bestCol = cur[col];
 	}
       }
       if (bestCol < scoreThreshold) return row - 1;
+      prev.swap(cur);
     }
     return 0;
   }
 
+  inline int32_t
+  longestHomology(std::string const& s1, std::string const& s2, int32_t scoreThreshold)  {
+    AlignWorkspace ws;
+    return longestHomology(s1, s2, scoreThreshold, ws);
+  }
+
+
+  // One DP row of the global alignment, columns [0, colEnd]
+  template<typename TAlignConfig, typename TScoreObject, typename TScoreValue>
+  inline void
+  _longNeedleRow(std::string const& s1, std::string const& s2, TAlignConfig const& ac, TScoreObject const& sc, std::size_t const row, std::size_t const colEnd, TScoreValue const* prev, TScoreValue* cur)
+  {
+    std::size_t m = s1.size();
+    std::size_t n = s2.size();
+    if (row == 0) {
+      cur[0] = 0;
+      for(std::size_t col = 1; col <= colEnd; ++col) cur[col] = cur[col-1] + _horizontalGap(ac, 0, m, sc.ge);
+    } else {
+      cur[0] = prev[0] + _verticalGap(ac, 0, n, sc.ge);
+      TScoreValue hg = _horizontalGap(ac, row, m, sc.ge);
+      for(std::size_t col = 1; col <= colEnd; ++col)
+	cur[col] = std::max(std::max(prev[col-1] + (s1[row-1] == s2[col-1] ? sc.match : sc.mismatch), prev[col] + _verticalGap(ac, col, n, sc.ge)), cur[col-1] + hg);
+    }
+  }
+
+  // Every k-th DP row, returns the alignment score
+  template<typename TAlignConfig, typename TScoreObject, typename TScoreValue>
+  inline TScoreValue
+  _longNeedleCheckpoints(std::string const& s1, std::string const& s2, TAlignConfig const& ac, TScoreObject const& sc, std::size_t const k, std::vector<TScoreValue>& chk)
+  {
+    std::size_t m = s1.size();
+    std::size_t n = s2.size();
+    chk.resize((m / k + 1) * (n + 1));
+    std::vector<TScoreValue> prev(n+1);
+    std::vector<TScoreValue> cur(n+1);
+    for(std::size_t row = 0; row <= m; ++row) {
+      _longNeedleRow(s1, s2, ac, sc, row, n, &prev[0], &cur[0]);
+      if (row % k == 0) std::copy(cur.begin(), cur.end(), chk.begin() + (row / k) * (n + 1));
+      prev.swap(cur);
+    }
+    return prev[n];
+  }
+
+  // DP rows [b*k, min(m, b*k+k)] recomputed from the checkpoint of block b
+  template<typename TAlignConfig, typename TScoreObject, typename TScoreValue>
+  inline void
+  _longNeedleBlock(std::string const& s1, std::string const& s2, TAlignConfig const& ac, TScoreObject const& sc, std::size_t const k, std::vector<TScoreValue> const& chk, std::size_t const b, std::size_t const colEnd, std::vector<TScoreValue>& block)
+  {
+    std::size_t m = s1.size();
+    std::size_t n = s2.size();
+    std::size_t first = b * k;
+    std::size_t last = std::min(m, first + k);
+    block.resize((k + 1) * (n + 1));
+    std::copy(chk.begin() + b * (n + 1), chk.begin() + b * (n + 1) + colEnd + 1, block.begin());
+    for(std::size_t row = first + 1; row <= last; ++row) _longNeedleRow(s1, s2, ac, sc, row, colEnd, &block[(row - first - 1) * (n + 1)], &block[(row - first) * (n + 1)]);
+  }
+
+  // Block holding DP row r and its predecessor
+  inline std::size_t
+  _longNeedleBlockIndex(std::size_t const r, std::size_t const k) {
+    return (r == 0) ? 0 : (r - 1) / k;
+  }
+
+  // Trace-back from (rr, cc), DP rows are recomputed block-wise
+  template<typename TAlignConfig, typename TScoreObject, typename TScoreValue>
+  inline void
+  _longNeedleTrace(std::string const& s1, std::string const& s2, TAlignConfig const& ac, TScoreObject const& sc, std::size_t const k, std::vector<TScoreValue> const& chk, std::size_t rr, std::size_t cc, std::vector<TScoreValue>& block, std::vector<char>& trace)
+  {
+    std::size_t m = s1.size();
+    std::size_t n = s2.size();
+    std::size_t colEnd = cc;
+    std::size_t b = _longNeedleBlockIndex(rr, k);
+    _longNeedleBlock(s1, s2, ac, sc, k, chk, b, colEnd, block);
+    while ((rr>0) || (cc>0)) {
+      if (_longNeedleBlockIndex(rr, k) != b) {
+	b = _longNeedleBlockIndex(rr, k);
+	_longNeedleBlock(s1, s2, ac, sc, k, chk, b, colEnd, block);
+      }
+      TScoreValue const* cur = &block[(rr - b * k) * (n + 1)];
+      if ((rr>0) && (cur[cc] == *(cur - (n + 1) + cc) + _verticalGap(ac, cc, n, sc.ge))) {
+	--rr;
+	trace.push_back('v');
+      } else if ((cc>0) && (cur[cc] == cur[cc-1] + _horizontalGap(ac, rr, m, sc.ge))) {
+	--cc;
+	trace.push_back('h');
+      } else {
+	--rr;
+	--cc;
+	trace.push_back('s');
+      }
+    }
+  }
 
   template<typename TAlign, typename TAlignConfig, typename TScoreObject>
   inline bool
@@ -68,22 +170,12 @@ namespace torali
   {
     typedef typename TScoreObject::TValue TScoreValue;
     typedef typename TAlign::index TAIndex;
+    typedef std::vector<TScoreValue> TRow;
 
-    // DP Matrix
-    typedef boost::multi_array<TScoreValue, 2> TMatrix;
+    // Only every k-th DP row is kept, the others are recomputed block-wise
     std::size_t m = s1.size();
     std::size_t n = s2.size();
-    TMatrix mat(boost::extents[m+1][n+1]);
-
-    // Initialization
-    mat[0][0] = 0;
-    for(std::size_t col = 1; col <= n; ++col) mat[0][col] = mat[0][col-1] + _horizontalGap(ac, 0, m, sc.ge);
-    for(std::size_t row = 1; row <= m; ++row) mat[row][0] = mat[row-1][0] + _verticalGap(ac, 0, n, sc.ge);
-
-    // Forward alignment
-    for(std::size_t row = 1; row <= m; ++row)
-      for(std::size_t col = 1; col <= n; ++col)
-	mat[row][col] = std::max(std::max(mat[row-1][col-1] + (s1[row-1] == s2[col-1] ? sc.match : sc.mismatch), mat[row-1][col] + _verticalGap(ac, col, n, sc.ge)), mat[row][col-1] + _horizontalGap(ac, row, m, sc.ge));
+    std::size_t k = std::max((std::size_t) 1, (std::size_t) std::sqrt((double) m));
 
     // Reverse input sequences
     std::string sRev1 = s1;
@@ -92,151 +184,100 @@ namespace torali
     reverseComplement(sRev2);
 
     // Reverse alignment
-    TMatrix rev(boost::extents[m+1][n+1]);
-    rev[0][0] = 0;
-    for(std::size_t col = 1; col <= n; ++col) rev[0][col] = rev[0][col-1] + _horizontalGap(ac, 0, m, sc.ge);
-    for(std::size_t row = 1; row <= m; ++row) rev[row][0] = rev[row-1][0] + _verticalGap(ac, 0, n, sc.ge);
-    for(std::size_t row = 1; row <= m; ++row)
-      for(std::size_t col = 1; col <= n; ++col)
-	rev[row][col] = std::max(std::max(rev[row-1][col-1] + (sRev1[row-1] == sRev2[col-1] ? sc.match : sc.mismatch), rev[row-1][col] + _verticalGap(ac, col, n, sc.ge)), rev[row][col-1] + _horizontalGap(ac, row, m, sc.ge));
-
-    if (mat[m][n] != rev[m][n]) {
-      //std::cerr << "Warning: Alignment scores disagree!" << std::endl;
-      return false;
-    } else {
-      // Find best join
-      TMatrix bestMat(boost::extents[m+1][n+1]);
-      for(std::size_t row = 0; row <= m; ++row) {
-	bestMat[row][0] = mat[row][0];
-	for(std::size_t col = 1; col <= n; ++col) {
-	  if (mat[row][col] > bestMat[row][col-1]) bestMat[row][col] = mat[row][col];
-	  else bestMat[row][col] = bestMat[row][col-1];
-	}
+    TRow revChk;
+    TScoreValue revScore = _longNeedleCheckpoints(sRev1, sRev2, ac, sc, k, revChk);
+
+    // Forward alignment and best join of forward row r with reverse row m-r
+    TRow fwdChk((m / k + 1) * (n + 1));
+    TRow prev(n+1);
+    TRow cur(n+1);
+    TRow bestFwd(n+1);
+    TRow bestRev(n+1);
+    TRow revBlock;
+    std::size_t revB = _longNeedleBlockIndex(m, k);
+    _longNeedleBlock(sRev1, sRev2, ac, sc, k, revChk, revB, n, revBlock);
+    TScoreValue bestScore = std::numeric_limits<TScoreValue>::min();
+    std::size_t consLeft = 0;
+    std::size_t refLeft = 0;
+    std::size_t refRight = 0;
+    for(std::size_t row = 0; row <= m; ++row) {
+      _longNeedleRow(s1, s2, ac, sc, row, n, &prev[0], &cur[0]);
+      if (row % k == 0) std::copy(cur.begin(), cur.end(), fwdChk.begin() + (row / k) * (n + 1));
+      std::size_t revRow = m - row;
+      if (_longNeedleBlockIndex(revRow, k) != revB) {
+	revB = _longNeedleBlockIndex(revRow, k);
+	_longNeedleBlock(sRev1, sRev2, ac, sc, k, revChk, revB, n, revBlock);
       }
-      TMatrix bestRev(boost::extents[m+1][n+1]);
-      for(std::size_t row = 0; row <= m; ++row) {
-	bestRev[row][0] = rev[row][0];
-	for(std::size_t col = 1; col <= n; ++col) {
-	  if (rev[row][col] > bestRev[row][col-1]) bestRev[row][col] = rev[row][col];
-	  else bestRev[row][col] = bestRev[row][col-1];
-	}
+      TScoreValue const* rev = &revBlock[(revRow - revB * k) * (n + 1)];
+      bestFwd[0] = cur[0];
+      bestRev[0] = rev[0];
+      for(std::size_t col = 1; col <= n; ++col) {
+	bestFwd[col] = std::max(cur[col], bestFwd[col-1]);
+	bestRev[col] = std::max(rev[col], bestRev[col-1]);
       }
-      TScoreValue bestScore = mat[m][n];
-      std::size_t consLeft = 0;
-      std::size_t refLeft = 0;
-      for(std::size_t row = 0; row<=m; ++row) {
-	for(std::size_t col = 0; col<=n; ++col) {
-	  if (bestMat[row][col]+bestRev[m-row][n-col] > bestScore) {
-	    bestScore=bestMat[row][col]+bestRev[m-row][n-col];
-	    consLeft = row;
-	    refLeft = col;
-	  }
+      bool improved = false;
+      for(std::size_t col = 0; col <= n; ++col) {
+	if (bestFwd[col] + bestRev[n-col] > bestScore) {
+	  bestScore = bestFwd[col] + bestRev[n-col];
+	  consLeft = row;
+	  refLeft = col;
+	  improved = true;
 	}
       }
-      std::size_t consRight = m - consLeft;
-      std::size_t refRight = 0;
       // Find right bound
-      for(std::size_t right = 0; right<=(n-refLeft); ++right) {
-	if (mat[consLeft][refLeft] + rev[consRight][right] == bestScore) {
-	  refRight = right;
+      if (improved) {
+	for(std::size_t right = 0; right<=(n-refLeft); ++right) {
+	  if (cur[refLeft] + rev[right] == bestScore) refRight = right;
 	}
       }
+      prev.swap(cur);
+    }
+    TScoreValue fwdScore = prev[n];
+    if (fwdScore != revScore) {
+      //std::cerr << "Warning: Alignment scores disagree!" << std::endl;
+      return false;
+    }
 
-      // Debug best join
-      /*
-      TScoreValue bScore = mat[m][n];
-      std::size_t cLeft = 0;
-      std::size_t cRight = 0;
-      std::size_t rLeft = 0;
-      std::size_t rRight = 0;
-      for(std::size_t fwdcut = 0; fwdcut<=m; ++fwdcut) {
-	std::size_t revcut = m - fwdcut;
-	// Iterate all valid collinear alignments on the reference
-	for(std::size_t left = 0; left<=n; ++left) {
-	  for(std::size_t right = 0; right<=(n-left); ++right) {
-	    if (mat[fwdcut][left] + rev[revcut][right] > bScore) {
-	      bScore = mat[fwdcut][left] + rev[revcut][right];
-	      cLeft = fwdcut;
-	      cRight = revcut;
-	      rLeft = left;
-	      rRight = right;
-	    }
-	  }
-	}
-      }
-      std::cerr << mat[m][n] << ',' << bScore << ';' << s1.size() << ',' << s2.size() << ';' << cLeft << ',' << (m-cRight) << ',' << rLeft << ',' << (n-rRight) << std::endl;
-      std::cerr << mat[m][n] << ',' << bestScore << ';' << s1.size() << ',' << s2.size() << ';' << consLeft << ',' << (m-consRight) << ',' << refLeft << ',' << (n-refRight) << std::endl;
-      */
-
-      // Better split found?
-      if (bestScore == mat[m][n]) return false; // No split found
-
-      // Trace-back fwd
-      std::size_t rr = consLeft;
-      std::size_t cc = refLeft;
-      typedef std::vector<char> TTrace;
-      TTrace trace;
-      while ((rr>0) || (cc>0)) {
-	if ((rr>0) && (mat[rr][cc] == mat[rr-1][cc] + _verticalGap(ac, cc, n, sc.ge))) {
-	  --rr;
-	  trace.push_back('v');
-	} else if ((cc>0) && (mat[rr][cc] == mat[rr][cc-1] + _horizontalGap(ac, rr, m, sc.ge))) {
-	  --cc;
-	  trace.push_back('h');
-	} else {
-	  --rr;
-	  --cc;
-	  trace.push_back('s');
-	}
+    // Better split found?
+    if (bestScore == fwdScore) return false; // No split found
+    std::size_t consRight = m - consLeft;
+
+    // Trace-back fwd
+    TRow block;
+    std::vector<char> trace;
+    _longNeedleTrace(s1, s2, ac, sc, k, fwdChk, consLeft, refLeft, block, trace);
+    TAlign fwd;
+    _createAlignment(trace, s1.substr(0, consLeft), s2.substr(0, refLeft), fwd);
+
+    // Trace-back rev
+    std::vector<char> rtrace;
+    _longNeedleTrace(sRev1, sRev2, ac, sc, k, revChk, consRight, refRight, block, rtrace);
+    TAlign rvs;
+    _createAlignment(rtrace, sRev1.substr(0, consRight), sRev2.substr(0, refRight), rvs);
+
+    // Concat alignments
+    std::size_t gapref = (n-refRight) - refLeft;
+    std::size_t alilen = fwd.shape()[1] + rvs.shape()[1] + gapref;
+    align.resize(boost::extents[2][alilen]);
+    TAIndex jEnd = rvs.shape()[1];
+    for(TAIndex i = 0; i < (TAIndex) fwd.shape()[0]; ++i) {
+      TAIndex alicol = 0;
+      for(;alicol < (TAIndex) fwd.shape()[1]; ++alicol) align[i][alicol]=fwd[i][alicol];
+      for(TAIndex j = refLeft; j < (TAIndex) (n-refRight); ++j, ++alicol) {
+	if (i==0) align[i][alicol] = '-';
+	else align[i][alicol] = s2[j];
       }
-      TAlign fwd;
-      _createAlignment(trace, s1.substr(0, consLeft), s2.substr(0, refLeft), fwd);
-
-      // Trace-back rev
-      rr = consRight;
-      cc = refRight;
-      typedef std::vector<char> TTrace;
-      TTrace rtrace;
-      while ((rr>0) || (cc>0)) {
-	if ((rr>0) && (rev[rr][cc] == rev[rr-1][cc] + _verticalGap(ac, cc, n, sc.ge))) {
-	  --rr;
-	  rtrace.push_back('v');
-	} else if ((cc>0) && (rev[rr][cc] == rev[rr][cc-1] + _horizontalGap(ac, rr, m, sc.ge))) {
-	  --cc;
-	  rtrace.push_back('h');
-	} else {
-	  --rr;
-	  --cc;
-	  rtrace.push_back('s');
+      for(TAIndex j = 0; j < (TAIndex) rvs.shape()[1]; ++j, ++alicol) {
+	switch (rvs[i][jEnd-j-1]) {
+	case 'A': align[i][alicol] = 'T'; break;
+	case 'C': align[i][alicol] = 'G'; break;
+	case 'G': align[i][alicol] = 'C'; break;
+	case 'T': align[i][alicol] = 'A'; break;
+	case 'N': align[i][alicol] = 'N'; break;
+	case '-': align[i][alicol] = '-'; break;
+	default: break;
 	}
       }
-      TAlign rvs;
-      _createAlignment(rtrace, sRev1.substr(0, consRight), sRev2.substr(0, refRight), rvs);
-
-      // Concat alignments
-      std::size_t gapref = (n-refRight) - refLeft;
-      std::size_t alilen = fwd.shape()[1] + rvs.shape()[1] + gapref;
-      align.resize(boost::extents[2][alilen]);
-      TAIndex jEnd = rvs.shape()[1];
-      for(TAIndex i = 0; i < (TAIndex) fwd.shape()[0]; ++i) {
-	TAIndex alicol = 0;
-	for(;alicol < (TAIndex) fwd.shape()[1]; ++alicol) align[i][alicol]=fwd[i][alicol];
-	for(TAIndex j = refLeft; j < (TAIndex) (n-refRight); ++j, ++alicol) {
-	  if (i==0) align[i][alicol] = '-';
-	  else align[i][alicol] = s2[j];
-	}
-	for(TAIndex j = 0; j < (TAIndex) rvs.shape()[1]; ++j, ++alicol) {
-	  switch (rvs[i][jEnd-j-1]) {
-	  case 'A': align[i][alicol] = 'T'; break;
-	  case 'C': align[i][alicol] = 'G'; break;
-	  case 'G': align[i][alicol] = 'C'; break;
-	  case 'T': align[i][alicol] = 'A'; break;
-	  case 'N': align[i][alicol] = 'N'; break;
-	  case '-': align[i][alicol] = '-'; break;
-	  default: break;
-	  }
-	}
-      } 
     }
     return true;
   }
@@ -289,23 +330,117 @@ namespace torali
     return s[n];
   }
   
-  template<typename TAlign1, typename TAlign2, typename TAlign, typename TAlignConfig, typename TScoreObject>
+  // Score of needle(s1, s2, align, AlignConfig<true, false>, sc) without traceback, striped over the rows of s1 (Farrar)
+  template<typename TScoreObject>
   inline int
-  needle(TAlign1 const& a1, TAlign2 const& a2, TAlign& align, TAlignConfig const& ac, TScoreObject const& sc)
+  semiglobalScore(std::string const& s1, std::string const& s2, TScoreObject const& sc, AlignWorkspace& ws)
+  {
+    AlignConfig<true, false> semiglobal;
+#ifdef __SSE2__
+    int32_t m = s1.size();
+    int32_t n = s2.size();
+    int32_t maxsc = std::max(std::max(std::abs((int32_t) sc.match), std::abs((int32_t) sc.mismatch)), std::abs((int32_t) sc.ge));
+    if ((m < 2) || (n < 1) || ((int64_t) (m + n + 1) * maxsc >= 16384)) return needleScore(s1, s2, semiglobal, sc);
+
+    // Rows 1..m-1 are striped over 8 lanes, the last row with free horizontal gaps is computed separately
+    int16_t const neginf = -16384;
+    int32_t nrows = m - 1;
+    int32_t segLen = (nrows + 7) / 8;
+    int32_t width = segLen * 8;
+
+    // Query profile for every character of s2
+    int32_t charIdx[256];
+    for(int32_t i = 0; i < 256; ++i) charIdx[i] = -1;
+    int32_t nchar = 0;
+    for(int32_t j = 0; j < n; ++j) {
+      if (charIdx[(uint8_t) s2[j]] == -1) charIdx[(uint8_t) s2[j]] = nchar++;
+    }
+    std::vector<int16_t>& prof = ws.prof;
+    prof.assign(nchar * width, 0);
+    for(int32_t i = 0; i < 256; ++i) {
+      if (charIdx[i] == -1) continue;
+      int16_t* p = &prof[charIdx[i] * width];
+      for(int32_t r = 0; r < nrows; ++r) p[(r % segLen) * 8 + r / segLen] = ((uint8_t) s1[r] == i) ? sc.match : sc.mismatch;
+    }
+
+    // First column
+    std::vector<int16_t>& hp = ws.hp;
+    std::vector<int16_t>& hc = ws.hc;
+    hp.assign(width, neginf);
+    hc.assign(width, neginf);
+    for(int32_t r = 0; r < nrows; ++r) hp[(r % segLen) * 8 + r / segLen] = (r + 1) * sc.ge;
+    int32_t last = ((nrows - 1) % segLen) * 8 + (nrows - 1) / segLen;
+    int32_t hm = m * sc.ge;
+
+    __m128i vGe = _mm_set1_epi16(sc.ge);
+    for(int32_t j = 0; j < n; ++j) {
+      int16_t const* p = &prof[charIdx[(uint8_t) s2[j]] * width];
+      __m128i vDiag = _mm_slli_si128(_mm_loadu_si128((__m128i const*) &hp[(segLen - 1) * 8]), 2);
+      __m128i vF = _mm_insert_epi16(_mm_set1_epi16(neginf), sc.ge, 0);
+      for(int32_t k = 0; k < segLen; ++k) {
+	__m128i vHp = _mm_loadu_si128((__m128i const*) &hp[k * 8]);
+	__m128i vH = _mm_adds_epi16(vDiag, _mm_loadu_si128((__m128i const*) &p[k * 8]));
+	vH = _mm_max_epi16(vH, _mm_adds_epi16(vHp, vGe));
+	vH = _mm_max_epi16(vH, vF);
+	_mm_storeu_si128((__m128i*) &hc[k * 8], vH);
+	vF = _mm_adds_epi16(vH, vGe);
+	vDiag = vHp;
+      }
+
+      // Vertical gaps crossing lane boundaries
+      vF = _mm_insert_epi16(_mm_slli_si128(vF, 2), neginf, 0);
+      int32_t k = 0;
+      __m128i vH = _mm_loadu_si128((__m128i const*) &hc[0]);
+      while (_mm_movemask_epi8(_mm_cmpgt_epi16(vF, vH))) {
+	_mm_storeu_si128((__m128i*) &hc[k * 8], _mm_max_epi16(vH, vF));
+	vF = _mm_adds_epi16(vF, vGe);
+	if (++k == segLen) {
+	  k = 0;
+	  vF = _mm_insert_epi16(_mm_slli_si128(vF, 2), neginf, 0);
+	}
+	vH = _mm_loadu_si128((__m128i const*) &hc[k * 8]);
+      }
+
+      // Last row
+      hm = std::max(std::max((int32_t) hp[last] + (s1[m-1] == s2[j] ? sc.match : sc.mismatch), (int32_t) hc[last] + sc.ge), hm);
+      hp.swap(hc);
+    }
+    return hm;
+#else
+    return needleScore(s1, s2, semiglobal, sc);
+#endif
+  }
+
+  template<typename TScoreObject>
+  inline int
+  semiglobalScore(std::string const& s1, std::string const& s2, TScoreObject const& sc)
+  {
+    AlignWorkspace ws;
+    return semiglobalScore(s1, s2, sc, ws);
+  }
+
+  // Score and reverse trace of the global alignment, buffers are taken from the workspace
+  template<typename TAlign1, typename TAlign2, typename TAlignConfig, typename TScoreObject>
+  inline int
+  _needleTrace(TAlign1 const& a1, TAlign2 const& a2, TAlignConfig const& ac, TScoreObject const& sc, AlignWorkspace& ws)
   {
     typedef typename TScoreObject::TValue TScoreValue;
 
     // DP Matrix
     std::size_t m = _size(a1, 1);
     std::size_t n = _size(a2, 1);
-    std::vector<TScoreValue> s(n+1, 0);
+    std::vector<int32_t>& s = ws.row1;
+    s.assign(n+1, 0);
     TScoreValue prevsub = 0;
 
     // Trace Matrix
     std::size_t mf = n+1;
-    typedef boost::dynamic_bitset<> TBitSet;
-    TBitSet bit3( (m+1) * (n+1), false);
-    TBitSet bit4( (m+1) * (n+1), false);
+    boost::dynamic_bitset<>& bit3 = ws.bit3;
+    boost::dynamic_bitset<>& bit4 = ws.bit4;
+    bit3.resize((m+1) * (n+1));
+    bit3.reset();
+    bit4.resize((m+1) * (n+1));
+    bit4.reset();
     
     // Create profile
     typedef boost::multi_array<double, 2> TProfile;
@@ -347,8 +482,8 @@ namespace torali
     // Trace-back using pointers
     std::size_t row = m;
     std::size_t col = n;
-    typedef std::vector<char> TTrace;
-    TTrace trace;
+    std::vector<char>& trace = ws.trace;
+    trace.clear();
     while ((row>0) || (col>0)) {
       if (bit3[row * mf + col]) {
 	--col;
@@ -363,13 +498,22 @@ namespace torali
       }
     }
 
-    // Create alignment
-    _createAlignment(trace, a1, a2, align);
-
     // Score
     return s[n];
   }
 
+  template<typename TAlign1, typename TAlign2, typename TAlign, typename TAlignConfig, typename TScoreObject>
+  inline int
+  needle(TAlign1 const& a1, TAlign2 const& a2, TAlign& align, TAlignConfig const& ac, TScoreObject const& sc)
+  {
+    AlignWorkspace ws;
+    int score = _needleTrace(a1, a2, ac, sc, ws);
+
+    // Create alignment
+    _createAlignment(ws.trace, a1, a2, align);
+    return score;
+  }
+
   template<typename TAlign1, typename TAlign2, typename TAlign, typename TAlignConfig>
   inline int
   needle(TAlign1 const& a1, TAlign2 const& a2, TAlign& align, TAlignConfig const& ac)
@@ -0,0 +1,214 @@
+/*
+============================================================================
+DELLY: Structural variant discovery by integrated PE mapping and SR analysis
+============================================================================
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include <boost/filesystem.hpp>
+
+#include <htslib/sam.h>
+
+#include <sys/types.h>
+#include <stdio.h>
+
+
+namespace torali
+{
+
+  #define DELLY_CACHE_BLOCK 256
+
+  // Fixed number of consecutive reads with their position range, allows to skip reads without split-read hits
+  struct ReadCacheBlock {
+    int32_t minPos;
+    int32_t maxPos;
+    uint32_t count;
+    off_t offset;
+
+    ReadCacheBlock(int32_t const p, off_t const off) : minPos(p), maxPos(p), count(0), offset(off) {}
+  };
+
+  // Contiguous block of cached reads for one sample and genomic shard
+  struct ReadCacheSegment {
+    uint32_t file_c;
+    int32_t tid;
+    uint32_t order;
+    uint32_t count;
+    off_t offset;
+    std::vector<ReadCacheBlock> blocks;
+
+    ReadCacheSegment(uint32_t const f, int32_t const t, uint32_t const o, uint32_t const n, off_t const off) : file_c(f), tid(t), order(o), count(n), offset(off) {}
+  };
+
+  template<typename TSegment>
+  struct SortReadCacheSegments : public std::binary_function<TSegment, TSegment, bool>
+  {
+    inline bool operator()(TSegment const& s1, TSegment const& s2) const {
+      return (s1.order < s2.order);
+    }
+  };
+
+  // Spill-to-disk cache of split-read candidates, written once during scanning and re-read by the assembly
+  struct ReadCache {
+    bool failed;
+    std::vector<boost::filesystem::path> path;
+    std::vector<FILE*> fp;
+    std::vector<std::vector<ReadCacheSegment> > segments;
+
+    ReadCache() : failed(false) {}
+  };
+
+  // Shard-local staging buffer, appended to the cache in one write
+  struct ReadCacheBuffer {
+    uint32_t count;
+    std::vector<char> data;
+    std::vector<ReadCacheBlock> blocks;
+
+    ReadCacheBuffer() : count(0) {}
+  };
+
+  struct CachedRead {
+    int32_t pos;
+    unsigned seed;
+    uint8_t qual;
+    int32_t l_qseq;
+    std::vector<uint8_t> packed;
+
+    CachedRead() : pos(0), seed(0), qual(0), l_qseq(0) {}
+  };
+
+
+  inline bool
+  _openReadCache(ReadCache& rc, uint32_t const nhandles) {
+    rc.path.resize(nhandles);
+    rc.fp.resize(nhandles, NULL);
+    rc.segments.resize(nhandles);
+    for(uint32_t h = 0; h < nhandles; ++h) {
+      boost::system::error_code ec;
+      boost::filesystem::path tmpdir = boost::filesystem::temp_directory_path(ec);
+      if (ec) tmpdir = boost::filesystem::path(".");
+      rc.path[h] = tmpdir / boost::filesystem::unique_path("delly-%%%%-%%%%-%%%%-%%%%.sr");
+      rc.fp[h] = fopen(rc.path[h].string().c_str(), "w+b");
+      if (rc.fp[h] == NULL) {
+	std::cerr << "Cannot create read cache " << rc.path[h].string() << std::endl;
+	return false;
+      }
+    }
+    return true;
+  }
+
+  template<typename TValue>
+  inline void
+  _appendRaw(std::vector<char>& data, TValue const& val) {
+    char const* p = reinterpret_cast<char const*>(&val);
+    data.insert(data.end(), p, p + sizeof(TValue));
+  }
+
+  // Stage a read, the sequence is kept 4-bit packed as in BAM
+  inline void
+  _cacheRead(ReadCacheBuffer& buf, bam1_t* rec, unsigned const seed) {
+    int32_t pos = rec->core.pos;
+    uint8_t qual = rec->core.qual;
+    int32_t l_qseq = rec->core.l_qseq;
+    if (buf.count % DELLY_CACHE_BLOCK == 0) buf.blocks.push_back(ReadCacheBlock(pos, buf.data.size()));
+    ReadCacheBlock& blk = buf.blocks.back();
+    blk.minPos = std::min(blk.minPos, pos);
+    blk.maxPos = std::max(blk.maxPos, pos);
+    ++blk.count;
+    _appendRaw(buf.data, pos);
+    _appendRaw(buf.data, seed);
+    _appendRaw(buf.data, qual);
+    _appendRaw(buf.data, l_qseq);
+    char const* seqptr = reinterpret_cast<char const*>(bam_get_seq(rec));
+    buf.data.insert(buf.data.end(), seqptr, seqptr + (l_qseq + 1) / 2);
+    ++buf.count;
+  }
+
+  // Write a staged shard as one segment, callers serialize access to a handle
+  inline bool
+  _flushCacheBuffer(ReadCache& rc, uint32_t const handle, uint32_t const file_c, int32_t const tid, uint32_t const order, ReadCacheBuffer& buf) {
+    bool written = true;
+    if (buf.count) {
+      off_t offset = ftello(rc.fp[handle]);
+      if ((offset < 0) || (fwrite(&buf.data[0], sizeof(char), buf.data.size(), rc.fp[handle]) != buf.data.size())) {
+	std::cerr << "Error: Cannot write read cache " << rc.path[handle].string() << std::endl;
+	rc.failed = true;
+	written = false;
+      } else {
+	rc.segments[handle].push_back(ReadCacheSegment(file_c, tid, order, buf.count, offset));
+	ReadCacheSegment& seg = rc.segments[handle].back();
+	seg.blocks.swap(buf.blocks);
+	for(uint32_t b = 0; b < seg.blocks.size(); ++b) seg.blocks[b].offset += seg.offset;
+      }
+    }
+    buf.count = 0;
+    std::vector<char>().swap(buf.data);
+    std::vector<ReadCacheBlock>().swap(buf.blocks);
+    return written;
+  }
+
+  // Flush and close the write handles, segments remain readable by path in shard order
+  inline bool
+  _finishReadCache(ReadCache& rc) {
+    for(uint32_t h = 0; h < rc.fp.size(); ++h) {
+      if (rc.fp[h] != NULL) {
+	if (fclose(rc.fp[h]) != 0) {
+	  std::cerr << "Error: Cannot write read cache " << rc.path[h].string() << std::endl;
+	  rc.failed = true;
+	}
+	rc.fp[h] = NULL;
+      }
+      std::sort(rc.segments[h].begin(), rc.segments[h].end(), SortReadCacheSegments<ReadCacheSegment>());
+    }
+    return !rc.failed;
+  }
+
+  inline bool
+  _nextCachedRead(FILE* f, CachedRead& cr) {
+    if (fread(&cr.pos, sizeof(int32_t), 1, f) != 1) return false;
+    if (fread(&cr.seed, sizeof(unsigned), 1, f) != 1) return false;
+    if (fread(&cr.qual, sizeof(uint8_t), 1, f) != 1) return false;
+    if (fread(&cr.l_qseq, sizeof(int32_t), 1, f) != 1) return false;
+    cr.packed.resize((cr.l_qseq + 1) / 2);
+    if ((!cr.packed.empty()) && (fread(&cr.packed[0], sizeof(uint8_t), cr.packed.size(), f) != cr.packed.size())) return false;
+    return true;
+  }
+
+  inline void
+  _decodeCachedRead(CachedRead const& cr, std::string& sequence) {
+    sequence.resize(cr.l_qseq);
+    for (int32_t i = 0; i < cr.l_qseq; ++i) sequence[i] = "=ACMGRSVTWYHKDBN"[(cr.packed[i>>1] >> ((~i&1)<<2)) & 0xf];
+  }
+
+  inline void
+  _closeReadCache(ReadCache& rc) {
+    _finishReadCache(rc);
+    for(uint32_t h = 0; h < rc.path.size(); ++h) {
+      boost::system::error_code ec;
+      boost::filesystem::remove(rc.path[h], ec);
+    }
+    rc.path.clear();
+    rc.fp.clear();
+    rc.segments.clear();
+  }
+
+}
+
+#endif
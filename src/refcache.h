@@ -0,0 +1,323 @@
+/*
+============================================================================
+DELLY: Structural variant discovery by integrated PE mapping and SR analysis
+============================================================================
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef REFCACHE_H
+#define REFCACHE_H
+
+#include <list>
+#include <map>
+#include <fstream>
+#include <cstring>
+#include <limits>
+
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <htslib/faidx.h>
+#include <zlib.h>
+#include "util.h"
+
+namespace torali
+{
+
+  // Held by the thread decoding a contig, other threads needing the contig block on it
+  struct RefLoadLock {
+#ifdef OPENMP
+    omp_lock_t lock;
+
+    RefLoadLock() { omp_init_lock(&lock); }
+    ~RefLoadLock() { omp_destroy_lock(&lock); }
+#endif
+  };
+
+  // Decoded reference contig
+  struct RefContig {
+    boost::shared_ptr<char> seq;
+    int32_t len;
+    bool ready;
+    boost::shared_ptr<RefLoadLock> loading;
+    std::list<std::string>::iterator pos;
+
+    RefContig() : len(-1), ready(false) {}
+  };
+
+  // Reference genome shared by all stages of a run, the least recently used contigs beyond the budget are released
+  struct ReferenceCache {
+    typedef boost::shared_ptr<char> TContig;
+    typedef std::map<std::string, RefContig> TContigMap;
+    faidx_t* fai;
+    std::string genome;
+    std::vector<faidx_t*> threadFai;
+    uint64_t budget;
+    uint64_t cached;
+    std::list<std::string> order;
+    TContigMap contigs;
+
+    ReferenceCache() : fai(NULL), budget(0), cached(0) {}
+  };
+
+  inline bool
+  _openReference(ReferenceCache& ref, boost::filesystem::path const& genome, uint64_t const budget) {
+    ref.fai = fai_load(genome.string().c_str());
+    ref.genome = genome.string();
+    ref.threadFai.assign(_maxThreads(), NULL);
+    ref.budget = budget;
+    ref.cached = 0;
+    return (ref.fai != NULL);
+  }
+
+  // Index handle of the calling thread, the shared handle is only used by the first thread
+  inline faidx_t*
+  _threadFai(ReferenceCache& ref) {
+    int32_t t = _threadNum();
+    if ((t == 0) || (t >= (int32_t) ref.threadFai.size())) return ref.fai;
+    if (ref.threadFai[t] == NULL) ref.threadFai[t] = fai_load(ref.genome.c_str());
+    return ref.threadFai[t];
+  }
+
+  // Contig sequence, decoded at most once while it stays in the cache, thread-safe
+  inline ReferenceCache::TContig
+  _fetchContig(ReferenceCache& ref, std::string const& name, int32_t& seqlen) {
+    ReferenceCache::TContig contig;
+    seqlen = -1;
+    while (true) {
+      bool load = false;
+      boost::shared_ptr<RefLoadLock> loading;
+#pragma omp critical (refcache)
+      {
+	ReferenceCache::TContigMap::iterator it = ref.contigs.find(name);
+	if (it == ref.contigs.end()) {
+	  // This thread decodes the contig
+	  load = true;
+	  loading = boost::shared_ptr<RefLoadLock>(new RefLoadLock());
+#ifdef OPENMP
+	  omp_set_lock(&loading->lock);
+#endif
+	  ref.contigs[name].loading = loading;
+	} else if (it->second.ready) {
+	  ref.order.splice(ref.order.begin(), ref.order, it->second.pos);
+	  contig = it->second.seq;
+	  seqlen = it->second.len;
+	} else loading = it->second.loading;
+      }
+      if (load) {
+	// Decode outside the critical section
+	faidx_t* fai = _threadFai(ref);
+	int32_t len = -1;
+	if (fai != NULL) contig = ReferenceCache::TContig(faidx_fetch_seq(fai, name.c_str(), 0, faidx_seq_len(fai, name.c_str()), &len), free);
+#pragma omp critical (refcache)
+	{
+	  if (contig) {
+	    seqlen = len;
+	    ref.order.push_front(name);
+	    RefContig& rc = ref.contigs[name];
+	    rc.seq = contig;
+	    rc.len = len;
+	    rc.ready = true;
+	    rc.loading.reset();
+	    rc.pos = ref.order.begin();
+	    ref.cached += len;
+	    // Evicted contigs still in use are freed with their last reference
+	    while ((ref.cached > ref.budget) && (ref.order.size() > 1)) {
+	      ReferenceCache::TContigMap::iterator itLast = ref.contigs.find(ref.order.back());
+	      ref.cached -= itLast->second.len;
+	      ref.contigs.erase(itLast);
+	      ref.order.pop_back();
+	    }
+	  } else ref.contigs.erase(name);
+	}
+#ifdef OPENMP
+	omp_unset_lock(&loading->lock);
+#endif
+	return contig;
+      }
+      if (!loading) return contig;
+      // Wait for the decoding thread, then look up again
+#ifdef OPENMP
+      omp_set_lock(&loading->lock);
+      omp_unset_lock(&loading->lock);
+#endif
+    }
+  }
+
+  // N-runs of a contig as sorted, disjoint half-open intervals
+  typedef std::vector<std::pair<int32_t, int32_t> > TNRuns;
+  typedef std::map<std::string, TNRuns> TNMask;
+
+  inline void
+  _scanNRuns(char const* seq, int32_t const seqlen, TNRuns& runs) {
+    runs.clear();
+    bool nrun = false;
+    int32_t nstart = seqlen;
+    for(int32_t i = 0; i < seqlen; ++i) {
+      if ((seq[i] != 'n') && (seq[i] != 'N')) {
+	if (nrun) {
+	  runs.push_back(std::make_pair(nstart, i));
+	  nrun = false;
+	}
+      } else {
+	if (!nrun) {
+	  nrun = true;
+	  nstart = i;
+	}
+      }
+    }
+    if (nrun) runs.push_back(std::make_pair(nstart, seqlen));
+  }
+
+  // First N-run overlapping [start, end), NULL if there is none
+  inline std::pair<int32_t, int32_t> const*
+  _findNRun(TNRuns const& runs, int32_t const start, int32_t const end) {
+    TNRuns::const_iterator it = std::upper_bound(runs.begin(), runs.end(), std::make_pair(start, std::numeric_limits<int32_t>::max()));
+    if ((it != runs.begin()) && ((it - 1)->first < end) && ((it - 1)->second > start)) return &(*(it - 1));
+    if ((it != runs.end()) && (it->first < end)) return &(*it);
+    return NULL;
+  }
+
+  // Checksum of the FASTA index, the N-mask sidecar is only valid for the same index
+  inline bool
+  _faiChecksum(boost::filesystem::path const& genome, uint32_t& crc) {
+    std::ifstream ifs((genome.string() + ".fai").c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!ifs.is_open()) return false;
+    uLong c = crc32(0L, Z_NULL, 0);
+    std::vector<char> buf(65536);
+    while (ifs) {
+      ifs.read(&buf[0], buf.size());
+      if (ifs.gcount()) c = crc32(c, reinterpret_cast<Bytef const*>(&buf[0]), ifs.gcount());
+    }
+    crc = (uint32_t) c;
+    return true;
+  }
+
+  template<typename TValue>
+  inline bool
+  _readRaw(char const*& p, char const* end, TValue& val) {
+    if (p + sizeof(TValue) > end) return false;
+    std::memcpy(&val, p, sizeof(TValue));
+    p += sizeof(TValue);
+    return true;
+  }
+
+  inline bool
+  _loadNMask(boost::filesystem::path const& path, uint32_t const crc, TNMask& mask) {
+    boost::system::error_code ec;
+    if ((!boost::filesystem::exists(path, ec)) || (!boost::filesystem::file_size(path, ec))) return false;
+    try {
+      boost::iostreams::mapped_file_source mf(path.string());
+      char const* p = mf.data();
+      char const* end = p + mf.size();
+      uint32_t magic = 0;
+      uint32_t fcrc = 0;
+      uint32_t ncontig = 0;
+      if ((!_readRaw(p, end, magic)) || (magic != 0x314d4e44)) return false;
+      if ((!_readRaw(p, end, fcrc)) || (fcrc != crc)) return false;
+      if (!_readRaw(p, end, ncontig)) return false;
+      for(uint32_t i = 0; i < ncontig; ++i) {
+	uint32_t len = 0;
+	if ((!_readRaw(p, end, len)) || (p + len > end)) return false;
+	TNRuns& runs = mask[std::string(p, p + len)];
+	p += len;
+	uint32_t nruns = 0;
+	if ((!_readRaw(p, end, nruns)) || (p + nruns * 2 * sizeof(int32_t) > end)) return false;
+	runs.resize(nruns);
+	for(uint32_t k = 0; k < nruns; ++k) {
+	  _readRaw(p, end, runs[k].first);
+	  _readRaw(p, end, runs[k].second);
+	}
+      }
+    } catch (std::exception const&) {
+      mask.clear();
+      return false;
+    }
+    return true;
+  }
+
+  inline bool
+  _writeNMask(boost::filesystem::path const& path, uint32_t const crc, TNMask const& mask) {
+    boost::filesystem::path tmp(path.string() + boost::filesystem::unique_path(".%%%%-%%%%").string());
+    std::ofstream ofs(tmp.string().c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!ofs.is_open()) return false;
+    uint32_t magic = 0x314d4e44;
+    uint32_t ncontig = mask.size();
+    ofs.write(reinterpret_cast<char const*>(&magic), sizeof(uint32_t));
+    ofs.write(reinterpret_cast<char const*>(&crc), sizeof(uint32_t));
+    ofs.write(reinterpret_cast<char const*>(&ncontig), sizeof(uint32_t));
+    for(TNMask::const_iterator it = mask.begin(); it != mask.end(); ++it) {
+      uint32_t len = it->first.size();
+      uint32_t nruns = it->second.size();
+      ofs.write(reinterpret_cast<char const*>(&len), sizeof(uint32_t));
+      ofs.write(it->first.data(), len);
+      ofs.write(reinterpret_cast<char const*>(&nruns), sizeof(uint32_t));
+      for(uint32_t k = 0; k < nruns; ++k) {
+	ofs.write(reinterpret_cast<char const*>(&it->second[k].first), sizeof(int32_t));
+	ofs.write(reinterpret_cast<char const*>(&it->second[k].second), sizeof(int32_t));
+      }
+    }
+    ofs.close();
+    boost::system::error_code ec;
+    if (ofs.fail()) {
+      boost::filesystem::remove(tmp, ec);
+      return false;
+    }
+    boost::filesystem::rename(tmp, path, ec);
+    if (ec) {
+      boost::filesystem::remove(tmp, ec);
+      return false;
+    }
+    return true;
+  }
+
+  // N-runs of the requested contigs, an N-mask file given by the user is re-used and extended by missing contigs
+  inline void
+  _loadOrBuildNMask(ReferenceCache& ref, boost::filesystem::path const& genome, boost::filesystem::path const& path, std::vector<std::string> const& names, TNMask& mask) {
+    uint32_t crc = 0;
+    bool keyed = ((!path.empty()) && (_faiChecksum(genome, crc)));
+    if ((keyed) && (!_loadNMask(path, crc, mask))) mask.clear();
+    bool added = false;
+    for(uint32_t i = 0; i < names.size(); ++i) {
+      if (mask.find(names[i]) != mask.end()) continue;
+      int32_t seqlen = -1;
+      ReferenceCache::TContig contig = _fetchContig(ref, names[i], seqlen);
+      _scanNRuns(contig.get(), seqlen, mask[names[i]]);
+      added = true;
+    }
+    if ((keyed) && (added) && (!_writeNMask(path, crc, mask))) std::cerr << "Warning: Cannot write N-mask " << path.string() << std::endl;
+  }
+
+  inline void
+  _closeReference(ReferenceCache& ref) {
+    ref.contigs.clear();
+    ref.order.clear();
+    ref.cached = 0;
+    for(uint32_t t = 0; t < ref.threadFai.size(); ++t) {
+      if (ref.threadFai[t] != NULL) fai_destroy(ref.threadFai[t]);
+    }
+    ref.threadFai.clear();
+    if (ref.fai != NULL) {
+      fai_destroy(ref.fai);
+      ref.fai = NULL;
+    }
+  }
+
+}
+
+#endif
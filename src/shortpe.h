@@ -25,6 +25,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include <iostream>
 #include <fstream>
+#include <queue>
 
 #include <boost/graph/adjacency_list.hpp>
 #include <boost/graph/graphviz.hpp>
@@ -57,6 +58,10 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include "split.h"
 #include "junction.h"
 #include "cluster.h"
+#include "readcache.h"
+#include "matetable.h"
+#include "extsort.h"
+#include "refcache.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -67,250 +72,478 @@ Contact: Tobias Rausch (rausch@embl.de)
 namespace torali
 {
   
-  template<typename TConfig, typename TValidRegion, typename TSRStore, typename TStructuralVariantRecord>
+  #define DELLY_SR_QUERY_GAP 1000
+
+  // Split-read of a translocation, merged across chromosomes in genome order
+  struct TraSplitRead {
+    uint32_t svid;
+    uint8_t qual;
+    std::string sequence;
+
+    TraSplitRead(uint32_t const s, uint8_t const q, std::string const& seq) : svid(s), qual(q), sequence(seq) {}
+  };
+
+  // Consensus path taken per assembled SV
+  #define DELLY_CONSENSUS_NONE 0
+  #define DELLY_CONSENSUS_ANCHORED 1
+  #define DELLY_CONSENSUS_MSA 2
+  #define DELLY_CONSENSUS_FALLBACK 3
+
+  // Whether [lower, upper] overlaps one of the sorted, disjoint query intervals
+  inline bool
+  _queryOverlap(std::vector<std::pair<int32_t, int32_t> > const& query, int32_t const lower, int32_t const upper) {
+    std::vector<std::pair<int32_t, int32_t> >::const_iterator it = std::lower_bound(query.begin(), query.end(), std::make_pair(lower, lower));
+    if ((it != query.end()) && (it->first <= upper)) return true;
+    if ((it != query.begin()) && ((it - 1)->second >= lower)) return true;
+    return false;
+  }
+
+  // Assign a cached read to its SV, intra-chromosomal SVs are assembled from reads of their own chromosome
+  template<typename TPosReadSV, typename TSVSequences, typename TQualVectors>
+  inline void
+  _assignSplitRead(int32_t const refIndex, CachedRead const& cr, TPosReadSV const& posReadSV, std::vector<StructuralVariantRecord> const& svs, uint32_t const maxReadPerSV, TSVSequences& seqStore, TQualVectors& qualStore, std::vector<TraSplitRead>& traReads) {
+    typename TPosReadSV::const_iterator it = posReadSV.find(std::make_pair(cr.pos, (std::size_t) cr.seed));
+    if (it == posReadSV.end()) return;
+    int32_t svid = it->second;
+    if (svid != (int32_t) svs[svid].id) return;  // Should never happen
+    bool tra = _translocation(svs[svid].svt);
+    if ((!tra) && (svs[svid].chr != refIndex)) return;
+    std::string sequence;
+    _decodeCachedRead(cr, sequence);
+
+    // Adjust orientation
+    bool bpPoint = false;
+    if (tra) {
+      if (refIndex == svs[svid].chr2) bpPoint = true;
+    } else {
+      // Only relevant for inversions
+      if (svs[svid].svt == 0) {
+	if (cr.pos + 25 > svs[svid].svStart) bpPoint = true;
+	else bpPoint = false;
+      } else if (svs[svid].svt == 1) {
+	if (cr.pos + 25 > svs[svid].svEnd) bpPoint = true;
+	else bpPoint = false;
+      }
+    }
+    _adjustOrientation(sequence, bpPoint, svs[svid].svt);
+
+    // At most n split-reads
+    if (tra) traReads.push_back(TraSplitRead(svid, cr.qual, sequence));
+    else if (seqStore[svid].size() < maxReadPerSV) {
+      if (seqStore[svid].insert(sequence).second) qualStore[svid].push_back(cr.qual);
+    }
+  }
+
+  template<typename TConfig, typename TSequences, typename TQualities>
   inline void
-  assembleSplitReads(TConfig const& c, TValidRegion const& validRegions, TSRStore const& srStore, std::vector<TStructuralVariantRecord>& svs) 
+  _assembleSV(TConfig const& c, bam_hdr_t* hdr, char const* seq, char const* sndSeq, TSequences const& sequences, TQualities& qual, StructuralVariantRecord& sv, uint8_t& path) {
+    bool msaSuccess = false;
+    path = DELLY_CONSENSUS_NONE;
+    if (sequences.size() > 1) {
+      // Clean junctions are laid out on shared k-mers, everything else goes through the full MSA
+      bool anchored = anchoredConsensus(sequences, sv.consensus);
+      if ((anchored) && (alignConsensus(c, hdr, seq, sndSeq, sv))) {
+	msaSuccess = true;
+	path = DELLY_CONSENSUS_ANCHORED;
+      } else {
+	if (anchored) path = DELLY_CONSENSUS_FALLBACK;
+	else path = DELLY_CONSENSUS_MSA;
+	msa(c, sequences, sv.consensus);
+	if (alignConsensus(c, hdr, seq, sndSeq, sv)) msaSuccess = true;
+      }
+    }
+    if (!msaSuccess) {
+      sv.consensus = "";
+      sv.srSupport = 0;
+      sv.srAlignQuality = 0;
+    } else {
+      // SR support and qualities
+      std::sort(qual.begin(), qual.end());
+      sv.srSupport = sequences.size();
+      sv.srMapQuality = qual[qual.size()/2];
+    }
+  }
+  
+  template<typename TConfig, typename TValidRegion, typename TSRStore, typename TStructuralVariantRecord>
+  inline bool
+  assembleSplitReads(TConfig const& c, TValidRegion const& validRegions, TSRStore const& srStore, ReadCache const& rc, ReferenceCache& ref, std::vector<TStructuralVariantRecord>& svs) 
   {
-    typedef typename TValidRegion::value_type TChrIntervals;
     typedef typename TSRStore::value_type TPosReadSV;
 
-    // Open file handles
-    typedef std::vector<samFile*> TSamFile;
-    typedef std::vector<hts_idx_t*> TIndex;
-    TSamFile samfile(c.files.size());
-    TIndex idx(c.files.size());
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      samfile[file_c] = sam_open(c.files[file_c].string().c_str(), "r");
-      hts_set_fai_filename(samfile[file_c], c.genome.string().c_str());
-      idx[file_c] = sam_index_load(samfile[file_c], c.files[file_c].string().c_str());
-    }
-    bam_hdr_t* hdr = sam_hdr_read(samfile[0]);
+    // Open header, split-read cache handles are opened per thread
+    samFile* samfile = sam_open(c.files[0].string().c_str(), "r");
+    _attachThreadPool(samfile, c.tpool);
+    hts_set_fai_filename(samfile, c.genome.string().c_str());
+    bam_hdr_t* hdr = sam_hdr_read(samfile);
+    int32_t nthreads = _maxThreads();
+    std::vector<std::vector<FILE*> > cachefp(nthreads, std::vector<FILE*>(rc.path.size(), NULL));
 
     // Reads per SV
     typedef std::set<std::string> TSequences;
     typedef std::vector<TSequences> TSVSequences;
+    TSVSequences seqStore(svs.size(), TSequences());
     TSVSequences traStore(svs.size(), TSequences());
     uint32_t maxReadPerSV = 20;
     typedef std::vector<uint8_t> TQualities;
     typedef std::vector<TQualities> TQualVectors;
+    TQualVectors qualStore(svs.size(), TQualities());
     TQualVectors traQualStore(svs.size(), TQualities());
+    std::vector<std::vector<TraSplitRead> > traReads(hdr->n_targets);
+    std::vector<uint8_t> consensusPath(svs.size(), DELLY_CONSENSUS_NONE);
+    
+    // Translocations bucketed by chromosome pair
+    typedef std::map<std::pair<int32_t, int32_t>, std::vector<uint32_t> > TChrPairSV;
+    TChrPairSV chrPairSV;
+    for(uint32_t svid = 0; svid < svs.size(); ++svid) {
+      if (!_translocation(svs[svid].svt)) continue;
+      if ((svs[svid].chr <= svs[svid].chr2) || (validRegions[svs[svid].chr].empty()) || (validRegions[svs[svid].chr2].empty())) continue;
+      chrPairSV[std::make_pair(svs[svid].chr2, svs[svid].chr)].push_back(svid);
+    }
+    std::vector<std::vector<uint32_t> > traBucket;
+    for(TChrPairSV::iterator it = chrPairSV.begin(); it != chrPairSV.end(); ++it) {
+      traBucket.push_back(std::vector<uint32_t>());
+      traBucket.back().swap(it->second);
+    }
     
-    // Parse BAM
+    // Parse cached split-reads, chromosomes in parallel
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Split-read assembly" << std::endl;
-    boost::progress_display show_progress( 2 * hdr->n_targets );
-
-    faidx_t* fai = fai_load(c.genome.string().c_str());
+    boost::progress_display show_progress( hdr->n_targets + traBucket.size() );
+    bool cacheError = false;
+#pragma omp parallel for default(shared) schedule(dynamic)
     for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
-      ++show_progress;
+#pragma omp critical
+      {
+	++show_progress;
+      }
       if (validRegions[refIndex].empty()) continue;
       if (srStore[refIndex].empty()) continue;
+      int32_t t = _threadNum();
 
-      // Load sequence
-      char* seq = NULL;
-      int32_t seqlen = -1;
-      std::string tname(hdr->target_name[refIndex]);
-      seq = faidx_fetch_seq(fai, tname.c_str(), 0, hdr->target_len[refIndex], &seqlen);
-      
-      // Collect all split-read pos
+      // Collect all split-read pos and merge them into query intervals
       typedef boost::dynamic_bitset<> TBitSet;
       TBitSet hits(hdr->target_len[refIndex]);
       for(typename TPosReadSV::const_iterator it = srStore[refIndex].begin(); it != srStore[refIndex].end(); ++it) hits[it->first.first] = 1;
+      std::vector<std::pair<int32_t, int32_t> > query;
+      for(TBitSet::size_type pos = hits.find_first(); pos != TBitSet::npos; pos = hits.find_next(pos)) {
+	if ((!query.empty()) && ((int32_t) pos <= query.back().second + DELLY_SR_QUERY_GAP)) query.back().second = pos;
+	else query.push_back(std::make_pair((int32_t) pos, (int32_t) pos));
+      }
 
-      // Sequences
-      TSVSequences seqStore(svs.size(), TSequences());
-      TQualVectors qualStore(svs.size(), TQualities());
-      
-      // Collect reads from all samples
-      for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-	// Read alignments
-	for(typename TChrIntervals::const_iterator vRIt = validRegions[refIndex].begin(); vRIt != validRegions[refIndex].end(); ++vRIt) {
-	  hts_itr_t* iter = sam_itr_queryi(idx[file_c], refIndex, vRIt->lower(), vRIt->upper());
-	  bam1_t* rec = bam_init1();
-	  while (sam_itr_next(samfile[file_c], iter, rec) >= 0) {
-	    if (rec->core.flag & (BAM_FQCFAIL | BAM_FDUP | BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
-	    if ((rec->core.qual < c.minMapQual) || (rec->core.tid<0)) continue;
-	    if (!hits[rec->core.pos]) continue;
-
-	    // Valid split-read
-	    std::size_t seed = hash_string(bam_get_qname(rec));
-	    typename TPosReadSV::const_iterator it = srStore[refIndex].find(std::make_pair(rec->core.pos, seed));
-	    if (it != srStore[refIndex].end()) {
-	      int32_t svid = it->second;
-
-	      // Get the sequence
-	      if (svid == (int32_t) svs[svid].id) {  // Should be always true
-		std::string sequence;
-		sequence.resize(rec->core.l_qseq);
-		uint8_t* seqptr = bam_get_seq(rec);
-		for (int i = 0; i < rec->core.l_qseq; ++i) sequence[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, i)];
-
-		// Adjust orientation
-		bool bpPoint = false;
-		if (_translocation(svs[svid].svt)) {
-		  if (rec->core.tid == svs[svid].chr2) bpPoint = true;
-		} else {
-		  // Only relevant for inversions
-		  if (svs[svid].svt == 0) {
-		    if (rec->core.pos + 25 > svs[svid].svStart) bpPoint = true;
-		    else bpPoint = false;
-		  } else if (svs[svid].svt == 1) {
-		    if (rec->core.pos + 25 > svs[svid].svEnd) bpPoint = true;
-		    else bpPoint = false;
-		  }
-		}
-		_adjustOrientation(sequence, bpPoint, svs[svid].svt);
-		
-		// At most n split-reads
-		if (seqStore[svid].size() < maxReadPerSV) {
-		  bool insertSuccess = false;
-		  if (_translocation(svs[svid].svt)) insertSuccess = traStore[svid].insert(sequence).second;
-		  else insertSuccess = seqStore[svid].insert(sequence).second;
-		  // Store qualities
-		  if (insertSuccess) {
-		    if (_translocation(svs[svid].svt)) traQualStore[svid].push_back(rec->core.qual);
-		    else qualStore[svid].push_back(rec->core.qual);
-		  }
+      // Collect reads from all samples, only cache blocks overlapping a query interval are read
+      CachedRead cr;
+      bool readError = false;
+      for(unsigned int file_c = 0; (file_c < c.files.size()) && (!readError); ++file_c) {
+	for(uint32_t h = 0; (h < rc.segments.size()) && (!readError); ++h) {
+	  for(uint32_t s = 0; (s < rc.segments[h].size()) && (!readError); ++s) {
+	    ReadCacheSegment const& seg = rc.segments[h][s];
+	    if ((seg.file_c != file_c) || (seg.tid != refIndex) || (!seg.count)) continue;
+	    off_t filePos = -1;
+	    for(uint32_t b = 0; (b < seg.blocks.size()) && (!readError); ++b) {
+	      ReadCacheBlock const& blk = seg.blocks[b];
+	      if (!_queryOverlap(query, blk.minPos, blk.maxPos)) continue;
+	      if (cachefp[t][h] == NULL) cachefp[t][h] = fopen(rc.path[h].string().c_str(), "rb");
+	      if ((cachefp[t][h] == NULL) || ((blk.offset != filePos) && (fseeko(cachefp[t][h], blk.offset, SEEK_SET) != 0))) {
+		std::cerr << "Error: Cannot read split-read cache " << rc.path[h].string() << std::endl;
+		readError = true;
+		break;
+	      }
+	      filePos = (b + 1 < seg.blocks.size()) ? seg.blocks[b+1].offset : -1;
+	      for(uint32_t k = 0; k < blk.count; ++k) {
+		if (!_nextCachedRead(cachefp[t][h], cr)) {
+		  std::cerr << "Error: Cannot read split-read cache " << rc.path[h].string() << std::endl;
+		  readError = true;
+		  break;
 		}
+		if (hits[cr.pos]) _assignSplitRead(refIndex, cr, srStore[refIndex], svs, maxReadPerSV, seqStore, qualStore, traReads[refIndex]);
 	      }
 	    }
 	  }
-	  bam_destroy1(rec);
-          hts_itr_destroy(iter);
 	}
       }
-
-      // Process all SVs on this chromosome
-      for(uint32_t svid = 0; svid < seqStore.size(); ++svid) {
-	if (_translocation(svs[svid].svt)) continue;
-	if (svs[svid].chr != refIndex) continue;
-
-	// MSA
-	bool msaSuccess = false;
-	if (seqStore[svid].size() > 1) {
-	  msa(c, seqStore[svid], svs[svid].consensus);
-	  if (alignConsensus(c, hdr, seq, NULL, svs[svid])) msaSuccess = true;
+      if (readError) {
+#pragma omp critical
+	{
+	  cacheError = true;
 	}
-	if (!msaSuccess) {
-	  svs[svid].consensus = "";
-	  svs[svid].srSupport = 0;
-	  svs[svid].srAlignQuality = 0;
-	} else {
-	  // SR support and qualities
-	  std::sort(qualStore[svid].begin(), qualStore[svid].end());
-	  svs[svid].srSupport = seqStore[svid].size();
-	  svs[svid].srMapQuality = qualStore[svid][qualStore[svid].size()/2];
+      }
+    }
+    if (cacheError) {
+      for(int32_t t = 0; t < nthreads; ++t) {
+	for(uint32_t h = 0; h < cachefp[t].size(); ++h) {
+	  if (cachefp[t][h] != NULL) fclose(cachefp[t][h]);
 	}
       }
-      // Clean-up
-      if (seq != NULL) free(seq);
+      bam_hdr_destroy(hdr);
+      sam_close(samfile);
+      return false;
     }
 
-    // Process translocations
-    for(int32_t refIndex2 = 0; refIndex2 < hdr->n_targets; ++refIndex2) {
-      ++show_progress;
-      if (validRegions[refIndex2].empty()) continue;
-      char* sndSeq = NULL;
-      for(int32_t refIndex = refIndex2 + 1; refIndex < hdr->n_targets; ++refIndex) {
-	if (validRegions[refIndex].empty()) continue;
-	char* seq = NULL;
-
-	// Iterate SVs
-	for(uint32_t svid = 0; svid < traStore.size(); ++svid) {
-	  if (!_translocation(svs[svid].svt)) continue;
-	  if ((svs[svid].chr != refIndex) || (svs[svid].chr2 != refIndex2)) continue;
-
-	  bool msaSuccess = false;
-	  if (traStore[svid].size() > 1) {
-	    // Lazy loading of references
-	    if (seq == NULL) {
-	      int32_t seqlen = -1;
-	      std::string tname(hdr->target_name[refIndex]);
-	      seq = faidx_fetch_seq(fai, tname.c_str(), 0, hdr->target_len[refIndex], &seqlen);
-	    }
-	    if (sndSeq == NULL) {
-	      int32_t seqlen = -1;
-	      std::string tname(hdr->target_name[refIndex2]);
-	      sndSeq = faidx_fetch_seq(fai, tname.c_str(), 0, hdr->target_len[refIndex2], &seqlen);
-	    }
-	    msa(c, traStore[svid], svs[svid].consensus);
-	    if (alignConsensus(c, hdr, seq, sndSeq, svs[svid])) msaSuccess = true;
-	  }
-	  if (!msaSuccess) {
-	    svs[svid].consensus = "";
-	    svs[svid].srSupport = 0;
-	    svs[svid].srAlignQuality = 0;
-	  } else {
-	    // SR support and qualities
-	    std::sort(traQualStore[svid].begin(), traQualStore[svid].end());
-	    svs[svid].srSupport = traStore[svid].size();
-	    svs[svid].srMapQuality = traQualStore[svid][traQualStore[svid].size()/2];
-	  }
+    // Translocation reads of both chromosomes
+    for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+      for(uint32_t i = 0; i < traReads[refIndex].size(); ++i) {
+	TraSplitRead const& tr = traReads[refIndex][i];
+	if (traStore[tr.svid].insert(tr.sequence).second) traQualStore[tr.svid].push_back(tr.qual);
+      }
+      std::vector<TraSplitRead>().swap(traReads[refIndex]);
+    }
+
+    // Intra-chromosomal SVs, grouped by chromosome so that threads re-use their loaded reference
+    std::vector<std::pair<int32_t, uint32_t> > intraSV;
+    for(uint32_t svid = 0; svid < svs.size(); ++svid) {
+      if (_translocation(svs[svid].svt)) continue;
+      if ((validRegions[svs[svid].chr].empty()) || (srStore[svs[svid].chr].empty())) continue;
+      intraSV.push_back(std::make_pair(svs[svid].chr, svid));
+    }
+    std::sort(intraSV.begin(), intraSV.end());
+    std::vector<int32_t> seqIndex(nthreads, -1);
+    std::vector<ReferenceCache::TContig> seq(nthreads);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(uint32_t i = 0; i < intraSV.size(); ++i) {
+      int32_t t = _threadNum();
+      int32_t refIndex = intraSV[i].first;
+      uint32_t svid = intraSV[i].second;
+      if ((seqStore[svid].size() > 1) && (seqIndex[t] != refIndex)) {
+	int32_t seqlen = -1;
+	seq[t] = _fetchContig(ref, std::string(hdr->target_name[refIndex]), seqlen);
+	seqIndex[t] = refIndex;
+      }
+      _assembleSV(c, hdr, seq[t].get(), NULL, seqStore[svid], qualStore[svid], svs[svid], consensusPath[svid]);
+      TSequences().swap(seqStore[svid]);
+    }
+    seq.clear();
+
+    // Process translocations, chromosome pairs in parallel
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(uint32_t b = 0; b < traBucket.size(); ++b) {
+#pragma omp critical
+      {
+	++show_progress;
+      }
+      ReferenceCache::TContig seq;
+      ReferenceCache::TContig sndSeq;
+      for(uint32_t i = 0; i < traBucket[b].size(); ++i) {
+	uint32_t svid = traBucket[b][i];
+	if ((traStore[svid].size() > 1) && (!seq)) {
+	  // Lazy loading of references
+	  int32_t seqlen = -1;
+	  seq = _fetchContig(ref, std::string(hdr->target_name[svs[svid].chr]), seqlen);
+	  sndSeq = _fetchContig(ref, std::string(hdr->target_name[svs[svid].chr2]), seqlen);
 	}
-	if (seq != NULL) free(seq);
+	_assembleSV(c, hdr, seq.get(), sndSeq.get(), traStore[svid], traQualStore[svid], svs[svid], consensusPath[svid]);
       }
-      if (sndSeq != NULL) free(sndSeq);
     }
 
+    // Consensus paths of this run
+    std::vector<uint32_t> pathCount(4, 0);
+    for(uint32_t svid = 0; svid < consensusPath.size(); ++svid) ++pathCount[consensusPath[svid]];
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Split-read consensus (anchored=" << pathCount[DELLY_CONSENSUS_ANCHORED] << ", msa=" << pathCount[DELLY_CONSENSUS_MSA] << ", anchored+msa=" << pathCount[DELLY_CONSENSUS_FALLBACK] << ")" << std::endl;
+
     // Clean-up
-    fai_destroy(fai);
-    bam_hdr_destroy(hdr);
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      hts_idx_destroy(idx[file_c]);
-      sam_close(samfile[file_c]);
+    for(int32_t t = 0; t < nthreads; ++t) {
+      for(uint32_t h = 0; h < cachefp[t].size(); ++h) {
+	if (cachefp[t][h] != NULL) fclose(cachefp[t][h]);
+      }
     }
+    bam_hdr_destroy(hdr);
+    sam_close(samfile);
+    return true;
   }
 
       
-  template<typename TConfig, typename TValidRegion, typename TSRStore, typename TSampleLib>
+  // Genomic window of one sample, the unit of work of the parallel scan
+  struct ScanShard {
+    uint32_t file_c;
+    int32_t tid;
+    int32_t start;
+    int32_t end;
+
+    ScanShard(uint32_t const f, int32_t const t, int32_t const s, int32_t const e) : file_c(f), tid(t), start(s), end(e) {}
+  };
+
+  // First mate whose partner may lie in a later shard
+  struct MateObs {
+    std::size_t hv;
+    bool tra;
+    uint8_t qual;
+    int32_t alen;
+    int32_t mtid;
+    int32_t mpos;
+
+    MateObs(std::size_t const h, bool const t, uint8_t const q, int32_t const a, int32_t const mt, int32_t const mp) : hv(h), tra(t), qual(q), alen(a), mtid(mt), mpos(mp) {}
+  };
+
+  // Second mate waiting for a first mate of an earlier shard
+  struct PendingMate {
+    std::size_t hv;
+    int32_t svt;
+    BamAlignRecord br;
+
+    PendingMate(std::size_t const h, int32_t const s, BamAlignRecord const& b) : hv(h), svt(s), br(b) {}
+  };
+
+  // Known alignment span of a read group with junctions
+  struct JunctionSpan {
+    int32_t ltid;
+    int32_t lpos;
+    int32_t htid;
+    int32_t hpos;
+  };
+
+  // Scan position after which a read group is complete
+  struct SpanHorizon {
+    int32_t tid;
+    int32_t pos;
+    unsigned seed;
+
+    SpanHorizon(int32_t const t, int32_t const p, unsigned const s) : tid(t), pos(p), seed(s) {}
+  };
+
+  template<typename TRecord>
+  struct SortSpanHorizon : public std::binary_function<TRecord, TRecord, bool>
+  {
+    inline bool operator()(TRecord const& h1, TRecord const& h2) const {
+      return ((h1.tid > h2.tid) || ((h1.tid == h2.tid) && (h1.pos > h2.pos)));
+    }
+  };
+
+  // Paired-end graph components in clustering order
+  template<typename TConfig>
+  inline void
+  _writeClusterStats(TConfig const& c, bam_hdr_t* hdr, std::vector<ComponentStats> const& stats) {
+    std::ofstream ofile(c.clusterStats.string().c_str());
+    if (!ofile.is_open()) {
+      std::cerr << "Warning: Cannot write cluster statistics to " << c.clusterStats.string() << std::endl;
+      return;
+    }
+    ofile << "svtype\tct\tchr\tstart\tchr2\tend\tvertices\tedges\tpruned\tsvs\tmicroseconds" << std::endl;
+    for(uint32_t i = 0; i < stats.size(); ++i) {
+      ofile << _addID(stats[i].svt) << '\t' << _addOrientation(stats[i].svt) << '\t' << hdr->target_name[stats[i].tid] << '\t' << stats[i].start << '\t' << hdr->target_name[stats[i].mtid] << '\t' << stats[i].end << '\t' << stats[i].vertices << '\t' << stats[i].edges << '\t' << stats[i].pruned << '\t' << stats[i].svs << '\t' << stats[i].usec << std::endl;
+    }
+    ofile.close();
+  }
+
+  #define DELLY_CLUSTER_PART 4096
+
+  // Stretch of sorted records of one SV type that clusters independently of its neighbours
+  struct ClusterPart {
+    int32_t svt;
+    uint32_t begin;
+    uint32_t end;
+
+    ClusterPart(int32_t const s, uint32_t const b, uint32_t const e) : svt(s), begin(b), end(e) {}
+  };
+
+  // No split-read edge spans a chromosome change or a gap beyond the read separation
+  inline bool
+  _independentSR(SRBamRecord const& prev, SRBamRecord const& next, uint32_t const maxReadSep) {
+    return ((prev.chr != next.chr) || ((uint32_t) (next.pos - prev.pos) > maxReadSep));
+  }
+
+  // No paired-end edge spans a gap beyond the insert size variability
+  inline bool
+  _independentPE(BamAlignRecord const& prev, BamAlignRecord const& next, int32_t const varisize, int32_t const svt) {
+    return (_minCoord(next.pos, next.mpos, svt) - _minCoord(prev.pos, prev.mpos, svt) > varisize);
+  }
+
+  // Split-reads assigned to an SV, keyed by read start and read hash
+  template<typename TSRBamRecords, typename TSRStore>
   inline void
-  scanPEandSR(TConfig const& c, TValidRegion const& validRegions, std::vector<StructuralVariantRecord>& svs, std::vector<StructuralVariantRecord>& srSVs, TSRStore& srStore, TSampleLib& sampleLib)
+  _storeSplitReads(bam_hdr_t* hdr, TSRBamRecords const& br, TSRStore& srStore) {
+    for(uint32_t i = 0; i < br.size(); ++i) {
+      // Read assigned?
+      if ((br[i].svid != -1) && (br[i].rstart != -1)) {
+	if (br[i].rstart < (int32_t) hdr->target_len[br[i].chr]) srStore[br[i].chr].insert(std::make_pair(std::make_pair(br[i].rstart, br[i].id), br[i].svid));
+	if (br[i].chr != br[i].chr2) {
+	  // Unclear which chr was primary alignment so insert both if and only if rstart < reference length
+	  if (br[i].rstart < (int32_t) hdr->target_len[br[i].chr2]) srStore[br[i].chr2].insert(std::make_pair(std::make_pair(br[i].rstart, br[i].id), br[i].svid));
+	}
+      }
+    }
+  }
+
+  // Alignment file and index of one sample, a scan thread holds one at a time
+  struct ScanHandle {
+    int32_t file_c;
+    samFile* samfile;
+    hts_idx_t* idx;
+
+    ScanHandle() : file_c(-1), samfile(NULL), idx(NULL) {}
+  };
+
+  inline void
+  _closeScanHandle(ScanHandle& sh) {
+    if (sh.idx != NULL) hts_idx_destroy(sh.idx);
+    if (sh.samfile != NULL) sam_close(sh.samfile);
+    sh.idx = NULL;
+    sh.samfile = NULL;
+    sh.file_c = -1;
+  }
+
+  template<typename TConfig>
+  inline bool
+  _openScanHandle(TConfig const& c, uint32_t const file_c, ScanHandle& sh) {
+    if ((sh.file_c == (int32_t) file_c) && (sh.samfile != NULL)) return true;
+    _closeScanHandle(sh);
+    sh.samfile = sam_open(c.files[file_c].string().c_str(), "r");
+    if (sh.samfile == NULL) {
+      std::cerr << "Fail to open file " << c.files[file_c].string() << std::endl;
+      return false;
+    }
+    _attachThreadPool(sh.samfile, c.tpool);
+    hts_set_fai_filename(sh.samfile, c.genome.string().c_str());
+    sh.idx = sam_index_load(sh.samfile, c.files[file_c].string().c_str());
+    if (sh.idx == NULL) {
+      std::cerr << "Fail to open index for " << c.files[file_c].string() << std::endl;
+      _closeScanHandle(sh);
+      return false;
+    }
+    sh.file_c = file_c;
+    return true;
+  }
+
+  template<typename TConfig, typename TValidRegion, typename TSRStore, typename TSampleLib>
+  inline bool
+  scanPEandSR(TConfig const& c, TValidRegion const& validRegions, std::vector<StructuralVariantRecord>& svs, std::vector<StructuralVariantRecord>& srSVs, TSRStore& srStore, TSampleLib& sampleLib, ReadCache& rc, ReadCache& jc)
   {
     typedef typename TValidRegion::value_type TChrIntervals;
 
-    // Open file handles
-    typedef std::vector<samFile*> TSamFile;
-    typedef std::vector<hts_idx_t*> TIndex;
-    TSamFile samfile(c.files.size());
-    TIndex idx(c.files.size());
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      samfile[file_c] = sam_open(c.files[file_c].string().c_str(), "r");
-      hts_set_fai_filename(samfile[file_c], c.genome.string().c_str());
-      idx[file_c] = sam_index_load(samfile[file_c], c.files[file_c].string().c_str());
+    // One open sample per thread, shards are file-major so threads rarely switch files
+    int32_t nthreads = _maxThreads();
+    std::vector<ScanHandle> handle(nthreads);
+    if (!_openScanHandle(c, 0, handle[0])) return false;
+    bam_hdr_t* hdr = sam_hdr_read(handle[0].samfile);
+    if (hdr == NULL) {
+      std::cerr << "Fail to open header for " << c.files[0].string() << std::endl;
+      _closeScanHandle(handle[0]);
+      return false;
     }
-    bam_hdr_t* hdr = sam_hdr_read(samfile[0]);
 
     // Split-read records
     typedef std::vector<SRBamRecord> TSRBamRecord;
     typedef std::vector<TSRBamRecord> TSvtSRBamRecord;
-    TSvtSRBamRecord srBR(2 * DELLY_SVT_TRANS, TSRBamRecord());
 
     // Create bam alignment record vector
     typedef std::vector<BamAlignRecord> TBamRecord;
     typedef std::vector<TBamRecord> TSvtBamRecord;
-    TSvtBamRecord bamRecord(2 * DELLY_SVT_TRANS, TBamRecord());
-     
-    // Parse genome, process chromosome by chromosome
-    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Paired-end and split-read scanning" << std::endl;
-    boost::progress_display show_progress( c.files.size() * hdr->n_targets );
-    // Iterate all samples
-#pragma omp parallel for default(shared)
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      // Inter-chromosomal mate map and alignment length
-      typedef std::pair<uint8_t, int32_t> TQualLen;
-      typedef boost::unordered_map<std::size_t, TQualLen> TMateMap;
-      std::vector<TMateMap> matetra(c.files.size());
 
-      // Split-read junctions
-      typedef std::vector<Junction> TJunctionVector;
-      typedef std::map<unsigned, TJunctionVector> TReadBp;
-      TReadBp readBp;
-      
-      // Iterate all chromosomes for that sample
-      for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
-	++show_progress;
+    // Sorted runs of paired-ends and split-reads, runs beyond the memory budget are spilled
+    uint64_t const budget = (uint64_t) c.maxMemory * 1024 * 1024;
+    ExternalRuns<BamAlignRecord> peRuns(2 * DELLY_SVT_TRANS, budget);
+    ExternalRuns<SRBamRecord> srRuns(2 * DELLY_SVT_TRANS, budget);
 
+    // Split the genome of every sample into fixed-size windows
+    int32_t const shardSize = 10000000;
+    std::vector<ScanShard> shards;
+    std::vector<uint32_t> sampleShards(c.files.size() + 1, 0);
+    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
+      sampleShards[file_c] = shards.size();
+      if (!_openScanHandle(c, file_c, handle[0])) {
+	bam_hdr_destroy(hdr);
+	return false;
+      }
+      for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
 	// Any data?
 	if (validRegions[refIndex].empty()) continue;
 	bool nodata = true;
@@ -319,203 +552,594 @@ namespace torali
 	if ((str.size() >= suffix.size()) && (str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0)) nodata = false;
 	uint64_t mapped = 0;
 	uint64_t unmapped = 0;
-	hts_idx_get_stat(idx[file_c], refIndex, &mapped, &unmapped);
+	hts_idx_get_stat(handle[0].idx, refIndex, &mapped, &unmapped);
 	if (mapped) nodata = false;
 	if (nodata) continue;
 
-	// Intra-chromosomal mate map and alignment length
-	TMateMap mateMap;
+	for(int32_t wstart = 0; wstart < (int32_t) hdr->target_len[refIndex]; wstart += shardSize) {
+	  int32_t wend = std::min(wstart + shardSize, (int32_t) hdr->target_len[refIndex]);
+	  for(typename TChrIntervals::const_iterator vRIt = validRegions[refIndex].begin(); vRIt != validRegions[refIndex].end(); ++vRIt) {
+	    if (((int32_t) vRIt->lower() < wend) && ((int32_t) vRIt->upper() > wstart)) {
+	      shards.push_back(ScanShard(file_c, refIndex, wstart, wend));
+	      break;
+	    }
+	  }
+	}
+      }
+    }
+    sampleShards[c.files.size()] = shards.size();
+
+    // Shard-local results
+    typedef std::pair<uint8_t, int32_t> TQualLen;
+    typedef MateTable<TQualLen> TMateMap;
+    typedef std::vector<Junction> TJunctionVector;
+    typedef std::map<unsigned, TJunctionVector> TReadBp;
+    typedef boost::unordered_map<unsigned, JunctionSpan> TSpanMap;
+    typedef std::priority_queue<SpanHorizon, std::vector<SpanHorizon>, SortSpanHorizon<SpanHorizon> > THorizon;
+    std::vector<TSvtSRBamRecord> shardSR(shards.size(), TSvtSRBamRecord(2 * DELLY_SVT_TRANS, TSRBamRecord()));
+    std::vector<std::vector<MateObs> > shardFirst(shards.size(), std::vector<MateObs>());
+    std::vector<std::vector<PendingMate> > shardPending(shards.size(), std::vector<PendingMate>());
+    std::vector<uint32_t> shardAbnormal(shards.size(), 0);
+
+    // Chromosome names of SA tags
+    boost::unordered_map<std::string, int32_t> chrMap;
+    for(int32_t refIndex = 0; refIndex < (int32_t) hdr->n_targets; ++refIndex) chrMap[std::string(hdr->target_name[refIndex])] = refIndex;
+     
+    // Parse genome, process shard by shard
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Paired-end and split-read scanning" << std::endl;
+    boost::progress_display show_progress( shards.size() );
+    bool scanError = false;
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(unsigned int s = 0; s < shards.size(); ++s) {
+#pragma omp critical
+      {
+	++show_progress;
+      }
+      uint32_t file_c = shards[s].file_c;
+      int32_t refIndex = shards[s].tid;
+      int32_t t = _threadNum();
+      if (!_openScanHandle(c, file_c, handle[t])) {
+#pragma omp critical
+	{
+	  scanError = true;
+	}
+	continue;
+      }
+
+      // Mate maps and alignment length
+      TSvtBamRecord shardBR(2 * DELLY_SVT_TRANS, TBamRecord());
+      TMateMap mateMap;
+      TMateMap matetra;
+
+      // Split-read junctions of open read groups, completed groups and candidates
+      TReadBp readBp;
+      TSpanMap openSpan;
+      THorizon horizon;
+      TReadBp finished;
+      ReadCacheBuffer cacheBuf;
+
+      // Read alignments
+      for(typename TChrIntervals::const_iterator vRIt = validRegions[refIndex].begin(); vRIt != validRegions[refIndex].end(); ++vRIt) {
+	if ((int32_t) vRIt->upper() <= shards[s].start) continue;
+	if ((int32_t) vRIt->lower() >= shards[s].end) break;
+	int32_t regionStart = std::max((int32_t) vRIt->lower(), shards[s].start);
+	int32_t regionEnd = std::min((int32_t) vRIt->upper(), shards[s].end);
+	bool splitRegion = (regionStart > (int32_t) vRIt->lower());
+	hts_itr_t* iter = sam_itr_queryi(handle[t].idx, refIndex, regionStart, regionEnd);
+	bam1_t* rec = bam_init1();
+	int32_t lastAlignedPos = 0;
+	std::set<std::size_t> lastAlignedPosReads;
+	while (sam_itr_next(handle[t].samfile, iter, rec) >= 0) {
+	  if (rec->core.flag & (BAM_FQCFAIL | BAM_FDUP | BAM_FUNMAP)) continue;
+	  if ((rec->core.qual < c.minMapQual) || (rec->core.tid<0)) continue;
+	  if ((splitRegion) && (rec->core.pos < regionStart)) continue; // Processed by the previous shard
 
-	// Read alignments
-	for(typename TChrIntervals::const_iterator vRIt = validRegions[refIndex].begin(); vRIt != validRegions[refIndex].end(); ++vRIt) {
-	  hts_itr_t* iter = sam_itr_queryi(idx[file_c], refIndex, vRIt->lower(), vRIt->upper());
-	  bam1_t* rec = bam_init1();
-	  int32_t lastAlignedPos = 0;
-	  std::set<std::size_t> lastAlignedPosReads;
-	  while (sam_itr_next(samfile[file_c], iter, rec) >= 0) {
-	    if (rec->core.flag & (BAM_FQCFAIL | BAM_FDUP | BAM_FUNMAP)) continue;
-	    if ((rec->core.qual < c.minMapQual) || (rec->core.tid<0)) continue;
+	  unsigned seed = hash_string(bam_get_qname(rec));
 
-	    unsigned seed = hash_string(bam_get_qname(rec));
+	  // Read groups whose alignments all lie behind the scan position are complete
+	  while ((!horizon.empty()) && ((horizon.top().tid < rec->core.tid) || ((horizon.top().tid == rec->core.tid) && (horizon.top().pos < rec->core.pos)))) {
+	    SpanHorizon hz = horizon.top();
+	    horizon.pop();
+	    typename TSpanMap::iterator itSpan = openSpan.find(hz.seed);
+	    if ((itSpan == openSpan.end()) || (itSpan->second.htid != hz.tid) || (itSpan->second.hpos != hz.pos)) continue; // Span was extended
+	    if ((itSpan->second.ltid < refIndex) || ((itSpan->second.ltid == refIndex) && (itSpan->second.lpos < shards[s].start))) continue; // Resolved across shards
+	    typename TReadBp::iterator itBp = readBp.find(hz.seed);
+	    if (itBp != readBp.end()) {
+	      TJunctionVector& jv = finished[hz.seed];
+	      jv.insert(jv.end(), itBp->second.begin(), itBp->second.end());
+	      readBp.erase(itBp);
+	    }
+	    openSpan.erase(itSpan);
+	  }
+	  if (finished.size() >= 4096) {
+	    selectSplitReads(c, finished, shardSR[s]);
+	    finished.clear();
+	  }
 	    
-	    // SV detection using single-end read
-	    uint32_t rp = rec->core.pos; // reference pointer
-	    uint32_t sp = 0; // sequence pointer
-
-	    // Parse the CIGAR
-	    uint32_t* cigar = bam_get_cigar(rec);
-	    for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
-	      if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
-		// match or mismatch
-		for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]);++k) {
-		  ++sp;
-		  ++rp;
-		}
-	      } else if (bam_cigar_op(cigar[i]) == BAM_CDEL) {
-		if (bam_cigar_oplen(cigar[i]) > c.minRefSep) _insertJunction(readBp, seed, rec, rp, sp, false);
-		rp += bam_cigar_oplen(cigar[i]);
-		if (bam_cigar_oplen(cigar[i]) > c.minRefSep) _insertJunction(readBp, seed, rec, rp, sp, true);
-	      } else if (bam_cigar_op(cigar[i]) == BAM_CINS) {
-		sp += bam_cigar_oplen(cigar[i]);
-	      } else if ((bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP)) {
-		int32_t finalsp = sp;
-		bool scleft = false;
-		if (sp == 0) {
-		  finalsp += bam_cigar_oplen(cigar[i]); // Leading soft-clip / hard-clip
-		  scleft = true;
-		  }
-		sp += bam_cigar_oplen(cigar[i]);
-		if (bam_cigar_oplen(cigar[i]) > c.minClip) _insertJunction(readBp, seed, rec, rp, finalsp, scleft);
-	      } else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) {
-		rp += bam_cigar_oplen(cigar[i]);
-	      } else {
-		std::cerr << "Warning: Unknown Cigar operation!" << std::endl;
+	  // SV detection using single-end read, secondary alignments are not referenced by SA tags and stay out of read groups
+	  uint32_t rp = rec->core.pos; // reference pointer
+	  uint32_t sp = 0; // sequence pointer
+	  bool junction = false;
+	  bool grouped = !(rec->core.flag & BAM_FSECONDARY);
+
+	  // Parse the CIGAR
+	  uint32_t* cigar = bam_get_cigar(rec);
+	  for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
+	    if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
+	      // match or mismatch
+	      for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]);++k) {
+		++sp;
+		++rp;
+	      }
+	    } else if (bam_cigar_op(cigar[i]) == BAM_CDEL) {
+	      if ((grouped) && (bam_cigar_oplen(cigar[i]) > c.minRefSep)) {
+		_insertJunction(readBp, seed, rec, rp, sp, false);
+		junction = true;
+	      }
+	      rp += bam_cigar_oplen(cigar[i]);
+	      if ((grouped) && (bam_cigar_oplen(cigar[i]) > c.minRefSep)) _insertJunction(readBp, seed, rec, rp, sp, true);
+	    } else if (bam_cigar_op(cigar[i]) == BAM_CINS) {
+	      sp += bam_cigar_oplen(cigar[i]);
+	    } else if ((bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP)) {
+	      int32_t finalsp = sp;
+	      bool scleft = false;
+	      if (sp == 0) {
+		finalsp += bam_cigar_oplen(cigar[i]); // Leading soft-clip / hard-clip
+		scleft = true;
+	      }
+	      sp += bam_cigar_oplen(cigar[i]);
+	      if ((grouped) && (bam_cigar_oplen(cigar[i]) > c.minClip)) {
+		_insertJunction(readBp, seed, rec, rp, finalsp, scleft);
+		junction = true;
+	      }
+	    } else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) {
+	      rp += bam_cigar_oplen(cigar[i]);
+	    } else {
+	      std::cerr << "Warning: Unknown Cigar operation!" << std::endl;
+	    }
+	  }
+
+	  // Track the alignment span of read groups with junctions, SA tags open a span so that later supplementary alignments join the group
+	  typename TSpanMap::iterator itSpan = openSpan.find(seed);
+	  if ((grouped) && ((junction) || (itSpan != openSpan.end()) || (bam_aux_get(rec, "SA") != NULL))) {
+	    JunctionSpan js;
+	    _junctionSpan(rec, chrMap, js.ltid, js.lpos, js.htid, js.hpos);
+	    if (itSpan == openSpan.end()) {
+	      openSpan.insert(std::make_pair(seed, js));
+	      horizon.push(SpanHorizon(js.htid, js.hpos, seed));
+	    } else {
+	      if ((js.ltid < itSpan->second.ltid) || ((js.ltid == itSpan->second.ltid) && (js.lpos < itSpan->second.lpos))) {
+		itSpan->second.ltid = js.ltid;
+		itSpan->second.lpos = js.lpos;
+	      }
+	      if ((js.htid > itSpan->second.htid) || ((js.htid == itSpan->second.htid) && (js.hpos > itSpan->second.hpos))) {
+		itSpan->second.htid = js.htid;
+		itSpan->second.hpos = js.hpos;
+		horizon.push(SpanHorizon(js.htid, js.hpos, seed));
 	      }
 	    }
+	  }
+
+	  // Keep primary split-read candidates for the assembly
+	  if ((junction) && (!(rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)))) _cacheRead(cacheBuf, rec, seed);
 	    
-	    // Paired-end clustering
-	    if (rec->core.flag & BAM_FPAIRED) {
-	      // Single-end library
-	      if (sampleLib[file_c].median == 0) continue; // Single-end library
-
-	      // Secondary/supplementary alignments, mate unmapped or blacklisted chr
-	      if (rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
-	      if ((rec->core.mtid<0) || (rec->core.flag & BAM_FMUNMAP)) continue;
-	      if (validRegions[rec->core.mtid].empty()) continue;
-	      if ((_translocation(rec)) && (rec->core.qual < c.minTraQual)) continue;
-
-	      // SV type	      
-	      int32_t svt = _isizeMappingPos(rec, sampleLib[file_c].maxISizeCutoff);
-	      if (svt == -1) continue;
-	      if ((c.svtcmd) && (c.svtset.find(svt) == c.svtset.end())) continue;
-
-	      // Check library-specific insert size for deletions
-	      if ((svt == 2) && (sampleLib[file_c].maxISizeCutoff > std::abs(rec->core.isize))) continue;
+	  // Paired-end clustering
+	  if (rec->core.flag & BAM_FPAIRED) {
+	    // Single-end library
+	    if (sampleLib[file_c].median == 0) continue; // Single-end library
+
+	    // Secondary/supplementary alignments, mate unmapped or blacklisted chr
+	    if (rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
+	    if ((rec->core.mtid<0) || (rec->core.flag & BAM_FMUNMAP)) continue;
+	    if (validRegions[rec->core.mtid].empty()) continue;
+	    if ((_translocation(rec)) && (rec->core.qual < c.minTraQual)) continue;
+
+	    // SV type	      
+	    int32_t svt = _isizeMappingPos(rec, sampleLib[file_c].maxISizeCutoff);
+	    if (svt == -1) continue;
+	    if ((c.svtcmd) && (c.svtset.find(svt) == c.svtset.end())) continue;
+
+	    // Check library-specific insert size for deletions
+	    if ((svt == 2) && (sampleLib[file_c].maxISizeCutoff > std::abs(rec->core.isize))) continue;
 	      
-	      // Clean-up the read store for identical alignment positions
-	      if (rec->core.pos > lastAlignedPos) {
-		lastAlignedPosReads.clear();
-		lastAlignedPos = rec->core.pos;
-	      }
+	    // Clean-up the read store for identical alignment positions
+	    if (rec->core.pos > lastAlignedPos) {
+	      lastAlignedPosReads.clear();
+	      lastAlignedPos = rec->core.pos;
+	    }
 	      
-	      // Get or store the mapping quality for the partner
-	      if (_firstPairObs(rec, lastAlignedPosReads)) {
-		// First read
-		lastAlignedPosReads.insert(seed);
-		std::size_t hv = hash_pair(rec);
-		if (_translocation(svt)) matetra[file_c][hv]= std::make_pair((uint8_t) rec->core.qual, alignmentLength(rec));
-		else mateMap[hv]= std::make_pair((uint8_t) rec->core.qual, alignmentLength(rec));
-	      } else {
-		// Second read
-		std::size_t hv = hash_pair_mate(rec);
-		int32_t alenmate = 0;
-		uint8_t pairQuality = 0;
-	        if (_translocation(svt)) {
-		  // Inter-chromosomal
-		  if ((matetra[file_c].find(hv) == matetra[file_c].end()) || (!matetra[file_c][hv].first)) continue; // Mate discarded
-		  TQualLen p = matetra[file_c][hv];
-		  pairQuality = std::min((uint8_t) p.first, (uint8_t) rec->core.qual);
-		  alenmate = p.second;
-		  matetra[file_c][hv].first = 0;
-		} else {
-		  // Intra-chromosomal
-		  if ((mateMap.find(hv) == mateMap.end()) || (!mateMap[hv].first)) continue; // Mate discarded
-		  TQualLen p = mateMap[hv];
-		  pairQuality = std::min((uint8_t) p.first, (uint8_t) rec->core.qual);
-		  alenmate = p.second;
-		  mateMap[hv].first = 0;
-		}
-
-#pragma omp critical
-		{
-		  bamRecord[svt].push_back(BamAlignRecord(rec, pairQuality, alignmentLength(rec), alenmate, sampleLib[file_c].median, sampleLib[file_c].mad, sampleLib[file_c].maxNormalISize));
-		}
-		++sampleLib[file_c].abnormal_pairs;
+	    // Get or store the mapping quality for the partner
+	    if (_firstPairObs(rec, lastAlignedPosReads)) {
+	      // First read
+	      lastAlignedPosReads.insert(seed);
+	      std::size_t hv = hash_pair(rec);
+	      TQualLen ql = std::make_pair((uint8_t) rec->core.qual, (int32_t) alignmentLength(rec));
+	      if (_translocation(svt)) _mateInsert(matetra, hv, rec->core.mtid, rec->core.mpos, ql, rec->core.tid, rec->core.pos);
+	      else _mateInsert(mateMap, hv, rec->core.mtid, rec->core.mpos, ql, rec->core.tid, rec->core.pos);
+	    } else {
+	      // Second read
+	      std::size_t hv = hash_pair_mate(rec);
+	      if (_translocation(svt)) {
+		// Inter-chromosomal, first mate was seen on a lower chromosome
+		shardPending[s].push_back(PendingMate(hv, svt, BamAlignRecord(rec, rec->core.qual, alignmentLength(rec), 0, sampleLib[file_c].maxNormalISize, file_c)));
+		continue;
+	      }
+	      // Intra-chromosomal
+	      TQualLen* itMate = _mateFind(mateMap, hv);
+	      if (itMate == NULL) {
+		// First mate may have been seen by an earlier shard
+		if (rec->core.mpos < shards[s].start) shardPending[s].push_back(PendingMate(hv, svt, BamAlignRecord(rec, rec->core.qual, alignmentLength(rec), 0, sampleLib[file_c].maxNormalISize, file_c)));
+		continue;
 	      }
+	      TQualLen mateQL = *itMate;
+	      _mateErase(mateMap, hv);
+	      if (!mateQL.first) continue; // Mate discarded
+	      uint8_t pairQuality = std::min((uint8_t) mateQL.first, (uint8_t) rec->core.qual);
+	      int32_t alenmate = mateQL.second;
+	      shardBR[svt].push_back(BamAlignRecord(rec, pairQuality, alignmentLength(rec), alenmate, sampleLib[file_c].maxNormalISize, file_c));
+	      ++shardAbnormal[s];
 	    }
 	  }
-	  bam_destroy1(rec);
-	  hts_itr_destroy(iter);
 	}
+	bam_destroy1(rec);
+	hts_itr_destroy(iter);
+      }
+
+      // Unmatched first mates are resolved across shards
+      for(uint32_t i = 0; i < mateMap.slots.size(); ++i) {
+	if ((mateMap.slots[i].used) && (mateMap.slots[i].value.first)) shardFirst[s].push_back(MateObs(mateMap.slots[i].hv, false, mateMap.slots[i].value.first, mateMap.slots[i].value.second, mateMap.slots[i].mtid, mateMap.slots[i].mpos));
+      }
+      for(uint32_t i = 0; i < matetra.slots.size(); ++i) {
+	if ((matetra.slots[i].used) && (matetra.slots[i].value.first)) shardFirst[s].push_back(MateObs(matetra.slots[i].hv, true, matetra.slots[i].value.first, matetra.slots[i].value.second, matetra.slots[i].mtid, matetra.slots[i].mpos));
+      }
+
+      // Split-reads of completed read groups, open ones are resolved across shards
+      selectSplitReads(c, finished, shardSR[s]);
+      TReadBp().swap(finished);
+      ReadCacheBuffer junctionBuf;
+      for(typename TReadBp::const_iterator itBp = readBp.begin(); itBp != readBp.end(); ++itBp) _cacheJunctions(junctionBuf, itBp->first, itBp->second);
+      TReadBp().swap(readBp);
+
+      // Sorted paired-end run of this shard
+      for(uint32_t svt = 0; svt < shardBR.size(); ++svt) std::sort(shardBR[svt].begin(), shardBR[svt].end(), SortBamRecords<BamAlignRecord>());
+
+      // Append split-read candidates, open read groups and paired-ends of this shard
+#pragma omp critical
+      {
+	_flushCacheBuffer(rc, file_c, file_c, refIndex, s, cacheBuf);
+	_flushCacheBuffer(jc, file_c, file_c, refIndex, s, junctionBuf);
+	for(uint32_t svt = 0; svt < shardBR.size(); ++svt) _addRun(peRuns, svt, 2 * s, shardBR[svt], true, SortBamRecords<BamAlignRecord>());
+      }
+    }
+    for(int32_t t = 0; t < nthreads; ++t) _closeScanHandle(handle[t]);
+    if ((scanError) || (rc.failed) || (jc.failed)) {
+      _closeRuns(peRuns);
+      _closeRuns(srRuns);
+      bam_hdr_destroy(hdr);
+      return false;
+    }
+
+    // Merge shards of each sample in genomic order
+    if (!_finishReadCache(jc)) {
+      _closeRuns(peRuns);
+      _closeRuns(srRuns);
+      bam_hdr_destroy(hdr);
+      return false;
+    }
+    bool spillError = false;
+#pragma omp parallel for default(shared)
+    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
+      // Cross-shard mates
+      TMateMap mateMap;
+      TMateMap matetra;
+      int32_t lastTid = -1;
+
+      // Split-read junctions
+      TReadBp readBp;
+      for(uint32_t s = sampleShards[file_c]; s < sampleShards[file_c + 1]; ++s) {
+	if (shards[s].tid != lastTid) {
+	  _mateClear(mateMap);
+	  lastTid = shards[s].tid;
+	}
+	TSvtBamRecord pendingBR(2 * DELLY_SVT_TRANS, TBamRecord());
+	for(uint32_t i = 0; i < shardPending[s].size(); ++i) {
+	  PendingMate& pm = shardPending[s][i];
+	  TMateMap& mm = _translocation(pm.svt) ? matetra : mateMap;
+	  TQualLen* itMate = _mateFind(mm, pm.hv);
+	  if (itMate == NULL) continue; // Mate discarded
+	  TQualLen mateQL = *itMate;
+	  _mateErase(mm, pm.hv);
+	  if (!mateQL.first) continue;
+	  pm.br.MapQuality = std::min((uint8_t) mateQL.first, pm.br.MapQuality);
+	  pm.br.malen = (uint16_t) mateQL.second;
+	  pendingBR[pm.svt].push_back(pm.br);
+	  ++shardAbnormal[s];
+	}
+	std::vector<PendingMate>().swap(shardPending[s]);
+	for(uint32_t svt = 0; svt < pendingBR.size(); ++svt) std::sort(pendingBR[svt].begin(), pendingBR[svt].end(), SortBamRecords<BamAlignRecord>());
+#pragma omp critical
+	{
+	  for(uint32_t svt = 0; svt < pendingBR.size(); ++svt) _addRun(peRuns, svt, 2 * s + 1, pendingBR[svt], true, SortBamRecords<BamAlignRecord>());
+	}
+	for(uint32_t i = 0; i < shardFirst[s].size(); ++i) {
+	  MateObs const& mo = shardFirst[s][i];
+	  if (mo.tra) _mateInsert(matetra, mo.hv, mo.mtid, mo.mpos, std::make_pair(mo.qual, mo.alen), shards[s].tid, shards[s].start);
+	  else _mateInsert(mateMap, mo.hv, mo.mtid, mo.mpos, std::make_pair(mo.qual, mo.alen), shards[s].tid, shards[s].start);
+	}
+	std::vector<MateObs>().swap(shardFirst[s]);
+	sampleLib[file_c].abnormal_pairs += shardAbnormal[s];
       }
 
-      // Process all junctions for this BAM file
-      for(typename TReadBp::iterator it = readBp.begin(); it != readBp.end(); ++it) {
-	std::sort(it->second.begin(), it->second.end(), SortJunction<Junction>());
+      // Read groups spanning shards or chromosomes, spilled in shard order
+      bool readError = false;
+      FILE* jf = fopen(jc.path[file_c].string().c_str(), "rb");
+      if (jf != NULL) {
+	unsigned seed = 0;
+	TJunctionVector jv;
+	for(uint32_t k = 0; (k < jc.segments[file_c].size()) && (!readError); ++k) {
+	  if (fseeko(jf, jc.segments[file_c][k].offset, SEEK_SET) != 0) readError = true;
+	  for(uint32_t g = 0; (g < jc.segments[file_c][k].count) && (!readError); ++g) {
+	    if (!_nextCachedJunctions(jf, seed, jv)) readError = true;
+	    else {
+	      TJunctionVector& bp = readBp[seed];
+	      bp.insert(bp.end(), jv.begin(), jv.end());
+	    }
+	  }
+	}
+	fclose(jf);
+      } else readError = true;
+      if (readError) {
+	std::cerr << "Error: Cannot read junction spill " << jc.path[file_c].string() << std::endl;
+#pragma omp critical
+	{
+	  spillError = true;
+	}
+	continue;
       }
 	
-      // Collect split-read SVs
+      // Collect split-read SVs, records are ordered by read as if all junctions were grouped at once
+      TSvtSRBamRecord sampleSR(2 * DELLY_SVT_TRANS, TSRBamRecord());
+      selectSplitReads(c, readBp, sampleSR);
+      TReadBp().swap(readBp);
+      for(uint32_t svt = 0; svt < sampleSR.size(); ++svt) {
+	for(uint32_t s = sampleShards[file_c]; s < sampleShards[file_c + 1]; ++s) {
+	  sampleSR[svt].insert(sampleSR[svt].end(), shardSR[s][svt].begin(), shardSR[s][svt].end());
+	  TSRBamRecord().swap(shardSR[s][svt]);
+	}
+	std::stable_sort(sampleSR[svt].begin(), sampleSR[svt].end(), SortSRBamRecordId<SRBamRecord>());
+      }
 #pragma omp critical
       {
-	if ((!c.svtcmd) || (c.svtset.find(2) != c.svtset.end())) selectDeletions(c, readBp, srBR);
-	if ((!c.svtcmd) || (c.svtset.find(3) != c.svtset.end())) selectDuplications(c, readBp, srBR);
-	if ((!c.svtcmd) || (c.svtset.find(0) != c.svtset.end()) || (c.svtset.find(1) != c.svtset.end())) selectInversions(c, readBp, srBR);
-	if ((!c.svtcmd) || (c.svtset.find(4) != c.svtset.end())) selectInsertions(c, readBp, srBR);
-	if ((!c.svtcmd) || (c.svtset.find(DELLY_SVT_TRANS) != c.svtset.end()) || (c.svtset.find(DELLY_SVT_TRANS + 1) != c.svtset.end()) || (c.svtset.find(DELLY_SVT_TRANS + 2) != c.svtset.end()) || (c.svtset.find(DELLY_SVT_TRANS + 3) != c.svtset.end())) selectTranslocations(c, readBp, srBR);
+	for(uint32_t svt = 0; svt < sampleSR.size(); ++svt) _addRun(srRuns, svt, file_c, sampleSR[svt], false, SortSRBamRecord<SRBamRecord>());
       }
     }
 
-    // Debug abnormal paired-ends and split-reads
-    //outputSRBamRecords(c, srBR);
+    // Order runs by shard and sample
+    bool runsOk = _finishRuns(peRuns, SortBamRecords<BamAlignRecord>());
+    if (!_finishRuns(srRuns, SortSRBamRecord<SRBamRecord>())) runsOk = false;
+    if ((!runsOk) || (spillError)) {
+      _closeRuns(peRuns);
+      _closeRuns(srRuns);
+      bam_hdr_destroy(hdr);
+      return false;
+    }
+
+    // Split-read cache is complete
+    if (!_finishReadCache(rc)) {
+      _closeRuns(peRuns);
+      _closeRuns(srRuns);
+      bam_hdr_destroy(hdr);
+      return false;
+    }
 
-    // Cluster split-read records
+    // Cluster split-read records, independent parts run in parallel and SV ids follow the serial order
     now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Split-read clustering" << std::endl;
-    boost::progress_display spSR( srBR.size() );
-    for(uint32_t svt = 0; svt < srBR.size(); ++svt) {
-      ++spSR;
+    std::vector<int32_t> srSvt;
+    for(int32_t svt = 0; svt < (int32_t) srRuns.runs.size(); ++svt) {
       if ((c.svtcmd) && (c.svtset.find(svt) == c.svtset.end())) continue;
-      if (srBR[svt].empty()) continue;
-      
-      // Sort
-      std::sort(srBR[svt].begin(), srBR[svt].end(), SortSRBamRecord<SRBamRecord>());
+      if (!srRuns.runs[svt].empty()) srSvt.push_back(svt);
+    }
+    if (srRuns.fp == NULL) {
+      // Concatenate in sample order and sort
+      std::vector<TSRBamRecord> srBR(srRuns.runs.size(), TSRBamRecord());
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for(int32_t k = 0; k < (int32_t) srSvt.size(); ++k) {
+	int32_t svt = srSvt[k];
+	for(uint32_t r = 0; r < srRuns.runs[svt].size(); ++r) {
+	  srBR[svt].insert(srBR[svt].end(), srRuns.runs[svt][r].buf.begin(), srRuns.runs[svt][r].buf.end());
+	  TSRBamRecord().swap(srRuns.runs[svt][r].buf);
+	}
+	std::sort(srBR[svt].begin(), srBR[svt].end(), SortSRBamRecord<SRBamRecord>());
+      }
 
-      // Cluster
-      cluster(c, srBR[svt], srSVs, c.maxReadSep, svt);
+      // Parts of (svt, chromosome), large chromosomes are cut further at independent gaps
+      std::vector<ClusterPart> parts;
+      for(uint32_t k = 0; k < srSvt.size(); ++k) {
+	TSRBamRecord const& br = srBR[srSvt[k]];
+	uint32_t begin = 0;
+	for(uint32_t i = 1; i < br.size(); ++i) {
+	  if ((br[i-1].chr != br[i].chr) || ((i - begin >= DELLY_CLUSTER_PART) && (_independentSR(br[i-1], br[i], c.maxReadSep)))) {
+	    parts.push_back(ClusterPart(srSvt[k], begin, i));
+	    begin = i;
+	  }
+	}
+	parts.push_back(ClusterPart(srSvt[k], begin, br.size()));
+      }
+      std::vector<std::vector<StructuralVariantRecord> > partSV(parts.size());
+      boost::progress_display spSR( parts.size() );
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for(int32_t p = 0; p < (int32_t) parts.size(); ++p) {
+#pragma omp critical
+	{
+	  ++spSR;
+	}
+	TSRBamRecord& svtBR = srBR[parts[p].svt];
+	TSRBamRecord br(svtBR.begin() + parts[p].begin, svtBR.begin() + parts[p].end);
+	cluster(c, br, partSV[p], c.maxReadSep, parts[p].svt);
+	for(uint32_t i = 0; i < br.size(); ++i) svtBR[parts[p].begin + i].svid = br[i].svid;
+      }
+      for(uint32_t p = 0; p < parts.size(); ++p) {
+	int32_t offset = srSVs.size();
+	for(uint32_t i = 0; i < partSV[p].size(); ++i) {
+	  partSV[p][i].id += offset;
+	  srSVs.push_back(partSV[p][i]);
+	}
+	TSRBamRecord& svtBR = srBR[parts[p].svt];
+	for(uint32_t i = parts[p].begin; i < parts[p].end; ++i) {
+	  if (svtBR[i].svid != -1) svtBR[i].svid += offset;
+	}
+      }
+      for(uint32_t k = 0; k < srSvt.size(); ++k) _storeSplitReads(hdr, srBR[srSvt[k]], srStore);
+    } else {
+      // Stream the merged runs of each SV type, independent stretches are clustered as they complete
+      std::vector<std::vector<StructuralVariantRecord> > svtSV(srRuns.runs.size());
+      std::vector<TSRBamRecord> assigned(srRuns.runs.size(), TSRBamRecord());
+      boost::progress_display spSR( srSvt.size() );
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for(int32_t k = 0; k < (int32_t) srSvt.size(); ++k) {
+#pragma omp critical
+	{
+	  ++spSR;
+	}
+	int32_t svt = srSvt[k];
+	TSRBamRecord br;
+	std::vector<uint32_t> heap;
+	_initMerge(srRuns, svt, heap, SortSRBamRecord<SRBamRecord>());
+	bool more = true;
+	while (more) {
+	  more = _nextMerged(srRuns, svt, heap, SortSRBamRecord<SRBamRecord>(), br);
+	  std::size_t n = br.size();
+	  if ((!more) || ((n > 1) && (_independentSR(br[n-2], br[n-1], c.maxReadSep)))) {
+	    SRBamRecord next = br.back();
+	    if (more) br.pop_back();
+	    cluster(c, br, svtSV[svt], c.maxReadSep, svt);
+	    for(uint32_t i = 0; i < br.size(); ++i) {
+	      if (br[i].svid != -1) assigned[svt].push_back(br[i]);
+	    }
+	    br.clear();
+	    if (more) br.push_back(next);
+	  }
+	}
+      }
+      for(uint32_t k = 0; k < srSvt.size(); ++k) {
+	int32_t svt = srSvt[k];
+	int32_t offset = srSVs.size();
+	for(uint32_t i = 0; i < svtSV[svt].size(); ++i) {
+	  svtSV[svt][i].id += offset;
+	  srSVs.push_back(svtSV[svt][i]);
+	}
+	for(uint32_t i = 0; i < assigned[svt].size(); ++i) assigned[svt][i].svid += offset;
+	_storeSplitReads(hdr, assigned[svt], srStore);
+      }
     }
+    if (srRuns.failed) {
+      _closeRuns(peRuns);
+      _closeRuns(srRuns);
+      bam_hdr_destroy(hdr);
+      return false;
+    }
+    _closeRuns(srRuns);
 
     // Debug SR SVs
     //outputStructuralVariants(c, srSVs);
 
-    // Cluster paired-end records
+    // Cluster paired-end records, independent parts run in parallel and SVs are appended in serial order
     now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Paired-end clustering" << std::endl;
-    boost::progress_display spPE( bamRecord.size() );
+    std::vector<int32_t> peSvt;
+    for(int32_t svt = 0; svt < (int32_t) peRuns.runs.size(); ++svt) {
+      if ((c.svtcmd) && (c.svtset.find(svt) == c.svtset.end())) continue;
+      if (!peRuns.runs[svt].empty()) peSvt.push_back(svt);
+    }
 
     // Maximum variability in insert size
     int32_t varisize = getVariability(c, sampleLib);      
-    for(int32_t svt = 0; svt < (int32_t) bamRecord.size(); ++svt) {
-      ++spPE;
-      if ((c.svtcmd) && (c.svtset.find(svt) == c.svtset.end())) continue;
-      if (bamRecord[svt].empty()) continue;
-	
-      // Sort BAM records according to position
-      std::sort(bamRecord[svt].begin(), bamRecord[svt].end(), SortBamRecords<BamAlignRecord>());
-
-      // Cluster
-      cluster(c, bamRecord[svt], svs, varisize, svt);
-    }
-
-    // Track split-reads
-    for(uint32_t svt = 0; svt < srBR.size(); ++svt) {
-      for(uint32_t i = 0; i < srBR[svt].size(); ++i) {
-	// Read assigned?
-	if ((srBR[svt][i].svid != -1) && (srBR[svt][i].rstart != -1)) {
-	  if (srBR[svt][i].rstart < (int32_t) hdr->target_len[srBR[svt][i].chr]) srStore[srBR[svt][i].chr].insert(std::make_pair(std::make_pair(srBR[svt][i].rstart, srBR[svt][i].id), srBR[svt][i].svid));
-	  if (srBR[svt][i].chr != srBR[svt][i].chr2) {
-	    // Unclear which chr was primary alignment so insert both if and only if rstart < reference length
-	    if (srBR[svt][i].rstart < (int32_t) hdr->target_len[srBR[svt][i].chr2]) srStore[srBR[svt][i].chr2].insert(std::make_pair(std::make_pair(srBR[svt][i].rstart, srBR[svt][i].id), srBR[svt][i].svid));
+    std::vector<ComponentStats> clusterStats;
+    if (peRuns.fp == NULL) {
+      // Merge the in-memory runs of each SV type
+      std::vector<TBamRecord> bamRecord(peRuns.runs.size(), TBamRecord());
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for(int32_t k = 0; k < (int32_t) peSvt.size(); ++k) {
+	std::vector<uint32_t> heap;
+	_initMerge(peRuns, peSvt[k], heap, SortBamRecords<BamAlignRecord>());
+	while (_nextMerged(peRuns, peSvt[k], heap, SortBamRecords<BamAlignRecord>(), bamRecord[peSvt[k]]));
+      }
+
+      // Parts of at least DELLY_CLUSTER_PART records, cut at independent gaps
+      std::vector<ClusterPart> parts;
+      for(uint32_t k = 0; k < peSvt.size(); ++k) {
+	TBamRecord const& br = bamRecord[peSvt[k]];
+	uint32_t begin = 0;
+	for(uint32_t i = 1; i < br.size(); ++i) {
+	  if ((i - begin >= DELLY_CLUSTER_PART) && (_independentPE(br[i-1], br[i], varisize, peSvt[k]))) {
+	    parts.push_back(ClusterPart(peSvt[k], begin, i));
+	    begin = i;
 	  }
 	}
+	parts.push_back(ClusterPart(peSvt[k], begin, br.size()));
+      }
+      std::vector<std::vector<StructuralVariantRecord> > partSV(parts.size());
+      std::vector<std::vector<ComponentStats> > partStats(parts.size());
+      boost::progress_display spPE( parts.size() );
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for(int32_t p = 0; p < (int32_t) parts.size(); ++p) {
+#pragma omp critical
+	{
+	  ++spPE;
+	}
+	TBamRecord br(bamRecord[parts[p].svt].begin() + parts[p].begin, bamRecord[parts[p].svt].begin() + parts[p].end);
+	cluster(c, br, partSV[p], sampleLib, varisize, parts[p].svt, partStats[p]);
+      }
+      for(uint32_t p = 0; p < parts.size(); ++p) {
+	svs.insert(svs.end(), partSV[p].begin(), partSV[p].end());
+	clusterStats.insert(clusterStats.end(), partStats[p].begin(), partStats[p].end());
+      }
+    } else {
+      // Stream the merged runs of each SV type, independent stretches are clustered as they complete
+      std::vector<std::vector<StructuralVariantRecord> > svtSV(peRuns.runs.size());
+      std::vector<std::vector<ComponentStats> > svtStats(peRuns.runs.size());
+      boost::progress_display spPE( peSvt.size() );
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for(int32_t k = 0; k < (int32_t) peSvt.size(); ++k) {
+#pragma omp critical
+	{
+	  ++spPE;
+	}
+	int32_t svt = peSvt[k];
+	TBamRecord br;
+	std::vector<uint32_t> heap;
+	_initMerge(peRuns, svt, heap, SortBamRecords<BamAlignRecord>());
+	bool more = true;
+	while (more) {
+	  more = _nextMerged(peRuns, svt, heap, SortBamRecords<BamAlignRecord>(), br);
+	  std::size_t n = br.size();
+	  if ((!more) || ((n > 1) && (_independentPE(br[n-2], br[n-1], varisize, svt)))) {
+	    BamAlignRecord next = br.back();
+	    if (more) br.pop_back();
+	    cluster(c, br, svtSV[svt], sampleLib, varisize, svt, svtStats[svt]);
+	    br.clear();
+	    if (more) br.push_back(next);
+	  }
+	}
+      }
+      for(uint32_t k = 0; k < peSvt.size(); ++k) {
+	svs.insert(svs.end(), svtSV[peSvt[k]].begin(), svtSV[peSvt[k]].end());
+	clusterStats.insert(clusterStats.end(), svtStats[peSvt[k]].begin(), svtStats[peSvt[k]].end());
       }
     }
+    if (peRuns.failed) {
+      _closeRuns(peRuns);
+      bam_hdr_destroy(hdr);
+      return false;
+    }
+    _closeRuns(peRuns);
+    if (c.hasClusterStats) _writeClusterStats(c, hdr, clusterStats);
 
     // Clean-up
     bam_hdr_destroy(hdr);
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      hts_idx_destroy(idx[file_c]);
-      sam_close(samfile[file_c]);
-    }
+    return true;
   }
 
 
@@ -29,14 +29,61 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <boost/iostreams/copy.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 #include <sstream>
 #include <math.h>
 #include "tags.h"
 
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
 
 namespace torali
 {
 
+  // OpenMP worker count and id of the calling thread
+  inline int
+  _maxThreads() {
+#ifdef OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+  }
+
+  inline int
+  _threadNum() {
+#ifdef OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+  }
+
+  // Shared htslib pool for BGZF/CRAM (de)compression, no pool for a single thread
+  inline bool
+  _initThreadPool(htsThreadPool& tp, uint16_t const threads) {
+    tp.pool = NULL;
+    tp.qsize = 0;
+    if (threads > 1) {
+      tp.pool = hts_tpool_init(threads);
+      if (tp.pool == NULL) return false;
+    }
+    return true;
+  }
+
+  inline void
+  _destroyThreadPool(htsThreadPool& tp) {
+    if (tp.pool != NULL) hts_tpool_destroy(tp.pool);
+    tp.pool = NULL;
+  }
+
+  inline void
+  _attachThreadPool(htsFile* fp, htsThreadPool* tp) {
+    if ((fp != NULL) && (tp != NULL) && (tp->pool != NULL)) hts_set_thread_pool(fp, tp);
+  }
+
   struct LibraryInfo {
     int32_t rs;
     int32_t median;
@@ -321,6 +368,7 @@ namespace torali
     TSamHeader hdr(c.files.size());
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       samfile[file_c] = sam_open(c.files[file_c].string().c_str(), "r");
+      _attachThreadPool(samfile[file_c], c.tpool);
       hts_set_fai_filename(samfile[file_c], c.genome.string().c_str());
       idx[file_c] = sam_index_load(samfile[file_c], c.files[file_c].string().c_str());
       hdr[file_c] = sam_hdr_read(samfile[file_c]);